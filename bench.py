@@ -0,0 +1,246 @@
+#!/usr/bin/env python
+
+''' Benchmarks for the binarytree extension.
+
+Usage: python bench.py [benchmark] [size]
+
+Each benchmark prints the time taken by its variants, best of three runs.
+Run under perf to count TLB misses too, for instance:
+
+	perf stat -e dTLB-loads,dTLB-load-misses python bench.py locate
+'''
+
+import binarytree
+import datetime
+import os
+import random
+import sys
+import time
+
+def best_of(runs, func, *args):
+	''' Returns the shortest of 'runs' timings of func(*args) '''
+
+	best = None
+	for i in xrange(runs):
+		start = time.time()
+		func(*args)
+		elapsed = time.time() - start
+		if best is None or elapsed < best:
+			best = elapsed
+
+	return best
+
+def report(name, seconds, ops):
+	print "%-30s %8.3fs %10.0f ops/s" % (name, seconds, ops / seconds)
+
+def locate_all(tree, keys):
+	locate = tree.locate
+	for key in keys:
+		locate(key)
+
+def bench_locate(size):
+	''' Random lookups in a large tree, with and without huge pages '''
+
+	keys = range(size)
+	random.seed(0)
+	random.shuffle(keys)
+
+	for enabled in (False, True):
+		binarytree.set_huge_pages(enabled)
+		tree = binarytree.BinaryTree()
+		tree.reserve(size)
+		for key in keys:
+			tree.insert(key)
+
+		name = "locate, huge pages %s" % ("on" if enabled else "off")
+		report(name, best_of(3, locate_all, tree, keys), size)
+
+		del tree
+
+	binarytree.set_huge_pages(True)
+
+def fill(balance, keys):
+	tree = binarytree.BinaryTree(balance=balance)
+	insert = tree.insert
+	for key in keys:
+		insert(key)
+
+	return tree
+
+def churn(tree, keys):
+	remove, insert = tree.remove, tree.insert
+	for key in keys:
+		remove(key)
+	for key in keys:
+		insert(key)
+
+def bench_balance(size):
+	''' Insertions, removals and lookups under each balancing scheme '''
+
+	keys = range(size)
+	random.seed(0)
+	random.shuffle(keys)
+	half = keys[:size // 2]
+
+	for balance in ("avl", "wavl", "scapegoat"):
+		report("insert, %s" % balance,
+			best_of(3, fill, balance, keys), size)
+
+		tree = fill(balance, keys)
+		report("remove and reinsert, %s" % balance,
+			best_of(3, churn, tree, half), 2 * len(half))
+		report("locate after churn, %s" % balance,
+			best_of(3, locate_all, tree, keys), size)
+
+		del tree
+
+def bench_skewed(size):
+	''' Lookups where a few hundred keys get most of the traffic '''
+
+	keys = range(size)
+	random.seed(0)
+	random.shuffle(keys)
+	hot = keys[:300]
+	lookups = [random.choice(hot) if random.random() < 0.9
+			else random.choice(keys) for i in xrange(size)]
+
+	for balance in ("avl", "splay", "semisplay"):
+		tree = binarytree.BinaryTree(keys, balance=balance)
+		report("skewed locate, %s" % balance,
+			best_of(3, locate_all, tree, lookups), size)
+
+		del tree
+
+def cut_ranges(tree, starts, width):
+	remove_range, insert = tree.remove_range, tree.insert
+	for start in starts:
+		remove_range(start, start + width)
+		for key in xrange(start, start + width):
+			insert(key)
+
+def bench_ranges(size):
+	''' Cutting ranges out of a tree and filling them back in '''
+
+	keys = range(size)
+	random.seed(0)
+	random.shuffle(keys)
+	starts = [random.randrange(size) for i in xrange(100)]
+
+	for balance in ("avl", "treap"):
+		report("insert, %s" % balance,
+			best_of(3, fill, balance, keys), size)
+
+		tree = fill(balance, keys)
+		report("remove_range of 100, %s" % balance,
+			best_of(3, cut_ranges, tree, starts, 100), len(starts))
+
+		del tree
+
+def remove_all(tree, keys):
+	remove = tree.remove
+	for key in keys:
+		remove(key)
+
+def bench_removals(size):
+	''' Bursts of removals, unlinking nodes or leaving tombstones '''
+
+	keys = range(size)
+	random.seed(0)
+	random.shuffle(keys)
+	burst = keys[:size // 5]
+
+	for tombstones in (0, 0.25):
+		# Each run needs a tree of its own
+		timings = []
+		for i in xrange(3):
+			tree = binarytree.BinaryTree(keys, tombstones=tombstones)
+			timings.append(best_of(1, remove_all, tree, burst))
+			del tree
+
+		report("remove burst, tombstones %s" % tombstones,
+			min(timings), len(burst))
+
+def bench_keys(size):
+	''' Lookups of composite, binary and datetime keys, as items or as keys '''
+
+	random.seed(0)
+	keys = [(random.randrange(100), random.random(), "seq%d" % i)
+			for i in xrange(size)]
+
+	for key_type in (None, "memcmp"):
+		tree = binarytree.BinaryTree(keys, key_type=key_type)
+		report("tuple locate, keys %s" % key_type,
+			best_of(3, locate_all, tree, keys), size)
+
+		del tree
+
+	uuids = [os.urandom(16) for i in xrange(size)]
+	for key_type in (None, "memcmp", "bytes16"):
+		tree = binarytree.BinaryTree(uuids, key_type=key_type)
+		report("uuid locate, keys %s" % key_type,
+			best_of(3, locate_all, tree, uuids), size)
+
+		del tree
+
+	start = datetime.datetime(2000, 1, 1)
+	times = [start + datetime.timedelta(seconds=random.random() * 1e9)
+			for i in xrange(size)]
+	for key_type in (None, "datetime"):
+		tree = binarytree.BinaryTree(times, key_type=key_type)
+		report("datetime locate, keys %s" % key_type,
+			best_of(3, locate_all, tree, times), size)
+
+		del tree
+
+def build(keys, key_type):
+	return binarytree.BinaryTree(keys, key_type=key_type)
+
+def sort_build(keys):
+	tree = binarytree.BinaryTree()
+	tree.apply_batch(keys, [])
+	return tree
+
+def bench_bulk(size):
+	''' Building a tree from unsorted integers, and merging batches in '''
+
+	random.seed(0)
+	keys = [random.getrandbits(63) for i in xrange(size)]
+	batch = [random.getrandbits(63) for i in xrange(size // 10)]
+	small = [random.getrandbits(63) for i in xrange(1000)]
+
+	# Without keys, BinaryTree(iterable) inserts items one by one, and
+	# apply_batch sorts them by comparison before building the tree
+	report("bulk build, insert", best_of(3, build, keys, None), size)
+	report("bulk build, sort", best_of(3, sort_build, keys), size)
+	report("bulk build, radix sort", best_of(3, build, keys, "int64"),
+		size)
+
+	for key_type in (None, "int64"):
+		tree = binarytree.BinaryTree(keys, key_type=key_type)
+		report("apply_batch, keys %s" % key_type,
+			best_of(3, tree.apply_batch, batch, batch[::2]),
+			len(batch))
+
+		# Small batches go into large trees in place
+		report("apply_batch of %d, keys %s" % (len(small), key_type),
+			best_of(3, tree.apply_batch, small, small[::2]),
+			len(small))
+
+		del tree
+
+BENCHMARKS = {
+	'balance': bench_balance,
+	'bulk': bench_bulk,
+	'keys': bench_keys,
+	'locate': bench_locate,
+	'ranges': bench_ranges,
+	'removals': bench_removals,
+	'skewed': bench_skewed,
+}
+
+if __name__ == "__main__":
+	names = sys.argv[1:2] or sorted(BENCHMARKS)
+	size = int(sys.argv[2]) if len(sys.argv) > 2 else 1000000
+
+	for name in names:
+		BENCHMARKS[name](size)
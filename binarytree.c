@@ -16,32 +16,214 @@
 
 #include <Python.h>
 #include <structmember.h>
+#include <datetime.h>
+#include <time.h>
+#include <math.h>
+
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
+
+#if defined(HAVE_MMAP) && defined(MAP_ANONYMOUS) && defined(MADV_HUGEPAGE)
+#define USE_HUGE_PAGES
+#endif
 
 /* A container for Python objects.
  * 'item' holds the actual data, a reference to a PyObject.
  * 'lchild' and 'rchild' refer to the left and right child nodes of a given
  * node.
- * 'balance' is the height balance of the node. -1 for left-unbalanced, 0 for
- * balanced and +1 for right-unbalanced.
- * 'height' keeps the maximum number of nodes between a node and a leaf.
- * It is initialized as 1 for leaves.
- */ 
+ * Whatever a balancing scheme keeps in each node follows the Node, as laid
+ * out by the tree's NodeLayout.
+ * Nodes are not Python objects. They belong to their tree, which allocates
+ * them from its NodePool, and are only exposed to the interpreter through
+ * NodeObject handles.
+ */
 typedef struct _Node {
-	PyObject_HEAD
-
 	PyObject * item;
 	struct _Node * lchild, * rchild;
-	int balance;
-	int height;
 } Node;
 
+/* Nodes are allocated from arenas, blocks of contiguous nodes.
+ * 'used' counts the nodes handed out so far, the rest have never been used.
+ * Nodes that have been released have a NULL 'item', so an arena can be torn
+ * down by scanning it linearly, without walking the tree.
+ * 'mapped' is the length of the memory mapping holding the arena, or 0 if it
+ * was allocated with PyMem_Malloc.
+ * 'stride' is the size of each node, which depends on the tree's NodeLayout,
+ * so nodes must be reached through NODEARENA_NODE.
+ * 'keys' is the offset of the reference each node holds to its key, for
+ * keys that are Python objects, which are released along with the items,
+ * or 0.
+ */
+typedef struct _NodeArena {
+	struct _NodeArena * next;
+	Py_ssize_t capacity;
+	Py_ssize_t used;
+	size_t mapped;
+	size_t stride;
+	size_t keys;
+	Node nodes[1];
+} NodeArena;
+
+#define NODEARENA_NODE(arena, i) \
+	((Node *) ((char *) (arena)->nodes + (i) * (arena)->stride))
+
+/* Arenas start small, so that small trees stay small, and double in size up
+ * to a single 2 MiB huge page.
+ * Arenas of more than half a huge page are rounded up to whole huge pages,
+ * mapped aligned to them, and the kernel is asked to back them with huge
+ * pages, so that descents in large trees touch fewer TLB entries. Such
+ * arenas take as many nodes as the mapping fits. Mapping falls back to
+ * PyMem_Malloc.
+ */
+#define NODEARENA_HUGE_PAGE ((size_t) 1 << 21)
+#define NODEARENA_MIN_NODES 16
+#define NODEARENA_MAX_NODES(stride) ((Py_ssize_t) \
+	((NODEARENA_HUGE_PAGE - offsetof(NodeArena, nodes)) / (stride)))
+
+/* The layout of the nodes of a tree. Every node starts with a Node, and is
+ * followed by the optional fields the tree keeps, at the offsets given
+ * here, which are 0 for fields the tree doesn't keep.
+ * 'fields' is the set of NODE_* flags for the fields kept.
+ * 'size' is the size of a whole node.
+ * 'parent' is the offset of a pointer to the node's parent, which lets
+ * cursors step between nodes without keeping the path from the root.
+ * 'count' is the offset of the number of nodes in the node's subtree, which
+ * lets items be found by rank in O(log n).
+ * 'priority' is the offset of the node's random priority in treaps.
+ * 'height' is the offset of the node's height, the maximum number of nodes
+ * between it and a leaf, which is 1 for leaves, followed by its balance,
+ * the height of its right subtree minus that of its left one. In WAVL
+ * trees, the height holds the node's rank instead, which is at least its
+ * height, and the balance is only kept up to date in AVL trees.
+ * 'dead' is the offset of a flag set on tombstones, nodes whose item was
+ * removed but which are kept in the tree to route lookups. Subtree sizes
+ * leave tombstones out.
+ * 'key' is the offset of the node's key, of 'keysize' bytes, which stands
+ * in for its item in comparisons in trees that encode items into keys. It
+ * comes first, next to the children, as descents read both.
+ */
+typedef struct {
+	int fields;
+	size_t size;
+	size_t parent;
+	size_t count;
+	size_t priority;
+	size_t height;
+	size_t dead;
+	size_t key;
+	size_t keysize;
+} NodeLayout;
+
+#define NODE_PARENTS 1
+#define NODE_COUNTS 2
+#define NODE_PRIORITIES 4
+#define NODE_HEIGHTS 8
+#define NODE_TOMBSTONES 16
+#define NODE_KEYS 32
+#define NODE_OBJECT_KEYS 64
+
+/* The fields that come with the balancing scheme, rather than options */
+#define NODE_BALANCER_FIELDS (NODE_PRIORITIES | NODE_HEIGHTS)
+
+/* The fields that come with the key type. Object keys are references to
+ * Python objects, owned by their node. */
+#define NODE_KEY_FIELDS (NODE_KEYS | NODE_OBJECT_KEYS)
+
+#define NODE_PARENT(layout, node) \
+	(*(Node **) ((char *) (node) + (layout)->parent))
+
+#define NODE_SET_PARENT(layout, node, p) do { \
+		if ( (layout)->parent != 0 && (node) != NULL ) \
+			NODE_PARENT(layout, node) = (p); \
+	} while (0)
+
+#define NODE_COUNT(layout, node) \
+	(*(Py_ssize_t *) ((char *) (node) + (layout)->count))
+
+/* The number of items in the subtree at 'node', which may be NULL.
+ * Tombstones aren't counted. */
+#define NODE_SUBTREE_COUNT(layout, node) \
+	((node) != NULL ? NODE_COUNT(layout, node) : 0)
+
+#define NODE_PRIORITY(layout, node) \
+	(*(unsigned int *) ((char *) (node) + (layout)->priority))
+
+#define NODE_HEIGHT(layout, node) \
+	(*(int *) ((char *) (node) + (layout)->height))
+
+#define NODE_BALANCE(layout, node) \
+	(*(int *) ((char *) (node) + (layout)->height + sizeof(int)))
+
+#define NODE_KEY(layout, node) \
+	((void *) ((char *) (node) + (layout)->key))
+
+#define NODE_KEY_OBJECT(layout, node) \
+	(*(PyObject **) NODE_KEY(layout, node))
+
+#define NODE_DEAD(layout, node) \
+	(*(int *) ((char *) (node) + (layout)->dead))
+
+/* Whether 'node' is a tombstone, in trees that may have them */
+#define NODE_IS_DEAD(layout, node) \
+	((layout)->dead != 0 && NODE_DEAD(layout, node))
+
+/* The height of the subtree at 'node', which may be NULL */
+#define NODE_SUBTREE_HEIGHT(layout, node) \
+	((node) != NULL ? NODE_HEIGHT(layout, node) : 0)
+
+#define NODE_UPDATE_COUNT(layout, node) do { \
+		if ( (layout)->count != 0 ) \
+			NODE_COUNT(layout, node) = \
+				!NODE_IS_DEAD(layout, node) + \
+				NODE_SUBTREE_COUNT(layout, (node)->lchild) + \
+				NODE_SUBTREE_COUNT(layout, (node)->rchild); \
+	} while (0)
+
+/* The storage of a tree's nodes.
+ * 'arenas' is the list of arenas, newest first.
+ * 'free' is a list of released nodes, linked through their 'rchild', which
+ * are reused before the newest arena is.
+ * 'size' counts the nodes in use, and 'capacity' the nodes the arenas can
+ * hold.
+ * 'layout' is the layout of the nodes, fixed while the pool has arenas.
+ */
+typedef struct {
+	NodeArena * arenas;
+	Node * free;
+	Py_ssize_t size;
+	Py_ssize_t capacity;
+	NodeLayout layout;
+} NodePool;
+
 /* The main binary tree class, exposed to the interpreter as BinaryTree.
- * 'root' holds a reference to the root (a Node) of the tree.
+ * 'root' holds the root of the tree, whose nodes live in 'pool'.
+ * 'epoch' is incremented whenever nodes are released, invalidating every
+ * Node and Subtree handed out before.
+ * 'version' is incremented by every change to the tree, so that cursors can
+ * tell when the tree changed under them.
+ * 'balancer' is the balancing scheme, fixed while the tree has items.
+ * 'peak' is the most items the tree has held since it was last rebuilt
+ * whole, which bounds the depth of scapegoat trees.
+ * 'tombstones' is the fraction of its nodes a tree lets be tombstones
+ * before it is purged of them, or 0 if removals unlink nodes right away.
+ * 'dead' counts the tombstones.
+ * 'keys' is how items are encoded into the keys kept in the nodes, or NULL
+ * if nodes are compared by their items. Like 'balancer', it is fixed while
+ * the tree has items.
  */
 typedef struct {
 	PyObject_HEAD
 
 	Node * root;
+	NodePool pool;
+	Py_ssize_t epoch;
+	Py_ssize_t version;
+	const struct _Balancer * balancer;
+	Py_ssize_t peak;
+	double tombstones;
+	Py_ssize_t dead;
+	const struct _KeyType * keys;
 } BinaryTree;
 
 /* Subtrees safely implement the recursive notion of a binary tree, ie, that
@@ -52,68 +234,471 @@ typedef struct {
  * the original tree -- in particular, insertions and removals would mess up
  * the 'height' and 'balance' fields of all nodes above the root of the
  * subtree in the original tree.
- * So we define a new type, a Subtree, which is basically an immutable
- * BinaryTree that can be safely shallow-copied into a full-fledged
- * BinaryTree.
+ * So we define a new type, a Subtree, which is a read-only view of the nodes
+ * below 'root' in 'tree', and can be safely shallow-copied into a
+ * full-fledged BinaryTree.
+ * 'epoch' is the epoch of 'tree' when the view was created.
+ */
+typedef struct {
+	PyObject_HEAD
+
+	BinaryTree * tree;
+	Node * root;
+	Py_ssize_t epoch;
+} Subtree;
+
+/* A handle to a node of a tree, exposed to the interpreter as Node.
+ * It keeps the tree alive, and holds its own reference to the node's item,
+ * so that the item can still be read after the node has been released.
  */
-typedef BinaryTree Subtree;
+typedef struct {
+	PyObject_HEAD
+
+	BinaryTree * tree;
+	Node * node;
+	Py_ssize_t epoch;
+	PyObject * item;
+} NodeObject;
 
-#define NODE_UPDATE_BALANCE(node) \
-	(node)->balance = ((node)->rchild ? (node)->rchild->height : 0) \
-			- ((node)->lchild ? (node)->lchild->height : 0)
+#define NODE_UPDATE_BALANCE(layout, node) do { \
+		if ( (layout)->height != 0 ) \
+			NODE_BALANCE(layout, node) = \
+				NODE_SUBTREE_HEIGHT(layout, (node)->rchild) - \
+				NODE_SUBTREE_HEIGHT(layout, (node)->lchild); \
+	} while (0)
 
-#define NODE_SET_LEAF(node) do { \
-				(node)->height = 1; \
+#define NODE_SET_LEAF(layout, node) do { \
 				(node)->rchild = NULL; \
 				(node)->lchild = NULL; \
-				(node)->balance = 0; \
+				if ( (layout)->height != 0 ) { \
+					NODE_HEIGHT(layout, node) = 1; \
+					NODE_BALANCE(layout, node) = 0; \
+				} \
 			 } while (0);
 
-#define NODE_IS_LEAF(node) ((node)->height == 1 ) && \
-			!((node)->lchild || (node)->rchild) && \
-			((node)->balance == 0)
+/* A growable array of Node pointers, used both as an explicit stack for
+ * iterative walks and as a flat, in-order list of nodes.
+ * Small arrays live in 'prealloc', so most walks never touch the heap.
+ * 'nodes' may point into the struct itself, so a NodeStack must not be
+ * copied after NodeStack_init.
+ */
+#define NODESTACK_PREALLOC 64
+
+typedef struct {
+	Node ** nodes;
+	Py_ssize_t len;
+	Py_ssize_t allocated;
+	Node * prealloc[NODESTACK_PREALLOC];
+} NodeStack;
+
+#define NODESTACK_POP(stack) ((stack)->nodes[--(stack)->len])
+
+/* A balancing scheme, which restores its invariant along 'path', the nodes
+ * from the root of 'tree' down to where the tree changed, updating the root
+ * of 'tree' if it moves.
+ * 'inserted' is called after a leaf is linked into the tree, with 'path'
+ * ending at the new leaf, and 'removed' after the subtree below the last
+ * node of 'path' lost a node.
+ * 'accessed' is called after a lookup, with 'path' ending at the last node
+ * compared, or is NULL if lookups leave the tree alone.
+ * AVL trees are the most rigidly balanced, which keeps lookups short, but
+ * may rotate at every level on removal. WAVL trees are AVL trees as long as
+ * there are no removals, and do O(1) amortized rotations per update, at the
+ * cost of trees up to twice as deep as AVL trees after many removals.
+ * Splay trees move every node they reach to the root, so that frequently
+ * used items stay near it, at the cost of rotations on every lookup and of
+ * O(n) worst-case depth. Semi-splay trees rotate half as often, and only
+ * halve the depth of the nodes they reach.
+ * Treaps keep their nodes in heap order of random priorities, which makes
+ * them balanced in expectation, and lets ranges be cut out of them with
+ * splits and merges that make no comparisons.
+ * Scapegoat trees keep nothing in their nodes, and instead rebuild whole
+ * subtrees once a leaf ends up too deep, which is O(log n) amortized.
+ * 'fields' are the NODE_BALANCER_FIELDS the scheme needs in every node.
+ */
+typedef struct _Balancer {
+	const char * name;
+	int fields;
+	void (* inserted)(BinaryTree * tree, NodeStack * path);
+	void (* removed)(BinaryTree * tree, NodeStack * path);
+	void (* accessed)(BinaryTree * tree, NodeStack * path);
+} Balancer;
+
+/* A way of encoding items into keys whose order is that of the items, so
+ * that descents can compare the keys kept in the nodes instead of calling
+ * back into the interpreter. Items are still kept, and returned as is.
+ * 'encode' stores the key of 'item' at 'key', or returns -1 with an
+ * exception set if the item can't be encoded, and 'compare' compares two
+ * keys, returning a negative, zero or positive number as memcmp does.
+ * 'size' is the size of the keys, and 'fields' are the NODE_KEY_FIELDS
+ * they need in every node.
+ * memcmp keys are byte strings, in which the items are encoded field by
+ * field, so that comparing composite keys such as tuples takes a single
+ * memcmp. bytes16 and bytes32 keys are strings of that many bytes, such as
+ * UUIDs and hashes, copied into the node and compared a word at a time.
+ * datetime keys are the microseconds since the epoch of datetimes, in UTC
+ * for those that have a UTC offset, compared as integers.
+ * 'integers' is set for key types whose keys are PY_LONG_LONGs, such as
+ * int64 and datetime keys, which batches are radix sorted by.
+ * 'mixed' is set for integer keys of two kinds that don't compare with each
+ * other, told apart by the lowest bit, such as those of naive and aware
+ * datetimes. It is the message of the TypeError raised when a tree holding
+ * keys of one kind is given one of the other.
+ */
+typedef struct _KeyType {
+	const char * name;
+	int fields;
+	size_t size;
+	int (* encode)(PyObject * item, void * key);
+	int (* compare)(const void * a, const void * b);
+	int integers;
+	const char * mixed;
+} KeyType;
+
+/* An item of a batch, with its integer key, biased so that it sorts as an
+ * unsigned integer */
+typedef struct {
+	unsigned PY_LONG_LONG key;
+	PyObject * item;
+} KeyedItem;
+
+/* Room for a key of any KeyType, such as that of a lookup's target */
+#define KEY_MAX_SIZE 32
+
+typedef union {
+	unsigned char bytes[KEY_MAX_SIZE];
+	PyObject * object;
+	PY_LONG_LONG align;
+} Key;
+
+/* A growable byte string, in which keys are encoded.
+ * Short strings live in 'prealloc'; as with NodeStack, a ByteBuffer must
+ * not be copied once in use.
+ */
+#define BYTEBUFFER_PREALLOC 64
+
+typedef struct {
+	unsigned char * data;
+	Py_ssize_t len;
+	Py_ssize_t allocated;
+	unsigned char prealloc[BYTEBUFFER_PREALLOC];
+} ByteBuffer;
+
+/* The rank of 'node' in a WAVL tree, which may be NULL */
+#define NODE_RANK(layout, node) NODE_SUBTREE_HEIGHT(layout, node)
+
+/* A cursor over a tree, exposed to the interpreter as Cursor.
+ * 'path' holds the nodes from the root of 'tree' down to the current node,
+ * so that stepping to either in-order neighbour takes amortized O(1).
+ * If the nodes of 'tree' keep parent pointers, 'path' only holds the
+ * current node, as the rest can be found from it.
+ * When the cursor is off the items, 'path' is empty, and 'side' tells
+ * whether it is before the first item (-1) or after the last one (1).
+ * 'version' is the version of 'tree' that 'path' is valid for.
+ */
+typedef struct {
+	PyObject_HEAD
+
+	BinaryTree * tree;
+	Py_ssize_t version;
+	int side;
+	NodeStack path;
+} Cursor;
+
+/* A queue of arenas whose items have yet to be released.
+ * 'index' is the next node to release in the arena at 'head'.
+ * 'busy' is set while items are being released. That may run arbitrary
+ * code, which may drop more trees; their arenas are queued, but not
+ * released reentrantly.
+ */
+typedef struct {
+	NodeArena * head, * tail;
+	Py_ssize_t index;
+	int busy;
+} ReleaseQueue;
+
+/* Trees dropped or cleared while deferred freeing is enabled are queued
+ * here, and freed at most 'release_chunk' nodes at a time by later tree
+ * operations, instead of all at once.
+ * A 'release_chunk' of 0 disables deferred freeing (the default).
+ */
+static ReleaseQueue pending_release;
+static Py_ssize_t release_chunk = 0;
+
+/* Whether large arenas are backed by huge pages (the default) */
+static int huge_pages = 1;
+
+/* State of the generator used when sampling without a seed */
+static unsigned PY_LONG_LONG random_state;
 
 /* Prototypes for NodeType methods */
-static Node * Node_new(void);
-static void Node_dealloc(Node * self);
-static int Node_traverse(Node * self, visitproc visit, void * arg);
-static void Node_clear(Node * self);
+static PyObject * Node_wrap(BinaryTree * tree, Node * node);
+static void Node_dealloc(NodeObject * self);
+static int Node_traverse(NodeObject * self, visitproc visit, void * arg);
+static int Node_clear(NodeObject * self);
 
 /* Prototypes for Node methods.
  * Generally, the corresponding BinaryTree methods are simply bindings
  * to these.
  */
-static BinaryTree * Node_lchild(Node * self);
-static BinaryTree * Node_rchild(Node * self);
-static Node * Node_insert(Node * root, Node * new);
-static Node * Node_copytree(Node * root);
-static int Node_inOrder(Node * root, PyObject * func);
-static int Node_preOrder(Node * root, PyObject * func);
-static int Node_postOrder(Node * root, PyObject * func);
+static PyObject * Node_lchild(NodeObject * self);
+static PyObject * Node_rchild(NodeObject * self);
+static Node * Node_new(NodePool * pool);
+static int Node_find(BinaryTree * tree, Node * root, PyObject * target,
+			Node ** found);
+static PyObject * Node_locate(BinaryTree * tree, Node * root,
+				PyObject * target);
+static Node * Node_copy(NodePool * pool, Node * node);
+static Node * Node_copytree(NodePool * pool, Node * root);
+static int Node_visit(BinaryTree * tree, Node * node, PyObject * func,
+			Py_ssize_t version);
+static int Node_inOrder(BinaryTree * tree, Node * root, PyObject * func,
+			Py_ssize_t version);
+static int Node_preOrder(BinaryTree * tree, Node * root, PyObject * func,
+			Py_ssize_t version);
+static int Node_postOrder(BinaryTree * tree, Node * root, PyObject * func,
+			Py_ssize_t version);
+static int Node_flatten(Node * root, NodeStack * out);
+static void Node_descend(NodeStack * path, Node * root, int forward);
+static void Node_step(NodeStack * path, int forward);
+static void Node_skipDead(NodeLayout * layout, NodeStack * path,
+				int forward);
+static Node * Node_select(NodeLayout * layout, Node * root, Py_ssize_t rank);
+static Node * Node_neighbour(NodeLayout * layout, Node * node, int forward);
+static Node * Node_buildBalanced(NodeLayout * layout, Node ** nodes,
+					Py_ssize_t n);
+static Node * Node_toVine(Node * root);
+static Node * Node_buildFromVine(NodeLayout * layout, Node ** head,
+					Py_ssize_t n);
+static Py_ssize_t Node_size(NodeLayout * layout, Node * root);
+
+/* Prototypes for node storage */
+static void NodeLayout_init(NodeLayout * layout, int fields, size_t keysize);
+static NodeArena * NodeArena_new(Py_ssize_t capacity, NodeLayout * layout);
+static void NodeArena_free(NodeArena * arena);
+static int NodePool_grow(NodePool * pool, Py_ssize_t capacity);
+static int NodePool_reserve(NodePool * pool, Py_ssize_t n);
+static Node * NodePool_alloc(NodePool * pool);
+static void NodePool_free(NodePool * pool, Node * node);
+static NodeArena * NodePool_detach(NodePool * pool);
+
+/* Prototypes for NodeStack helpers */
+static void NodeStack_init(NodeStack * stack);
+static void NodeStack_free(NodeStack * stack);
+static int NodeStack_reserve(NodeStack * stack, Py_ssize_t n);
+static int NodeStack_push(NodeStack * stack, Node * node);
+
+/* Prototypes for tree teardown */
+static void ReleaseQueue_push(ReleaseQueue * queue, NodeArena * arenas);
+static Py_ssize_t ReleaseQueue_release(ReleaseQueue * queue,
+					Py_ssize_t budget);
+static void releasePending(void);
 
 /* Prototypes for BinaryTreeType methods */
+static PyObject * BinaryTree_new(PyTypeObject * type, PyObject * args,
+					PyObject * kwds);
 static int BinaryTree_init(BinaryTree * t, PyObject * args, PyObject * kwds);
 static void BinaryTree_dealloc(BinaryTree * self);
 static int BinaryTree_traverse(BinaryTree * self, visitproc visit, void * arg);
-static void BinaryTree_clear(BinaryTree * self);
+static int BinaryTree_clear(BinaryTree * self);
 static int BinaryTree_contains(BinaryTree * self, PyObject * value);
 
 /* Protoypes for BinaryTree methods */
+static PyObject * BinaryTree_root(BinaryTree * self);
 static PyObject * BinaryTree_insert(BinaryTree * self, PyObject * new);
 static PyObject * BinaryTree_remove(BinaryTree * self, PyObject * target);
 static PyObject * BinaryTree_locate(BinaryTree * self, PyObject * target);
 static PyObject * BinaryTree_inOrder(BinaryTree * self, PyObject * func);
 static PyObject * BinaryTree_preOrder(BinaryTree * self, PyObject * func);
 static PyObject * BinaryTree_postOrder(BinaryTree * self, PyObject * func);
+static int BinaryTree_apply(BinaryTree * self, PyObject * inserts,
+				PyObject * removes);
+static int BinaryTree_applyInPlace(BinaryTree * self, PyObject ** iv,
+				PY_LONG_LONG * ik, Py_ssize_t ni,
+				PyObject ** rv, PY_LONG_LONG * rk,
+				Py_ssize_t nr);
+static void BinaryTree_pathTo(BinaryTree * self, Node * node,
+				NodeStack * path);
+static PyObject * BinaryTree_applyBatch(BinaryTree * self, PyObject * args);
+static PyObject * BinaryTree_clearNodes(BinaryTree * self);
+static PyObject * BinaryTree_reserve(BinaryTree * self, PyObject * arg);
+static PyObject * BinaryTree_shrink(BinaryTree * self);
+static PyObject * BinaryTree_rebuild(BinaryTree * self, PyObject * args,
+					PyObject * kwds);
+static PyObject * BinaryTree_capacity(BinaryTree * self);
+static PyObject * BinaryTree_balance(BinaryTree * self);
+static PyObject * BinaryTree_cursor(BinaryTree * self, PyObject * args);
+static PyObject * BinaryTree_iter(BinaryTree * self);
+static PyObject * BinaryTree_page(BinaryTree * self, PyObject * args,
+					PyObject * kwds);
+static int BinaryTree_seek(BinaryTree * self, PyObject * key, int strict,
+				NodeStack * path);
+static PyObject * BinaryTree_collect(BinaryTree * self, NodeStack * path,
+					int forward, Py_ssize_t limit);
+static PyObject * BinaryTree_extremes(BinaryTree * self, PyObject * arg,
+					int forward);
+static PyObject * BinaryTree_smallest(BinaryTree * self, PyObject * arg);
+static PyObject * BinaryTree_largest(BinaryTree * self, PyObject * arg);
+static PyObject * BinaryTree_sample(BinaryTree * self, PyObject * args,
+					PyObject * kwds);
+static PyObject * BinaryTree_quantileItem(BinaryTree * self, double q);
+static PyObject * BinaryTree_quantile(BinaryTree * self, PyObject * arg);
+static PyObject * BinaryTree_quantiles(BinaryTree * self, PyObject * arg);
+static int BinaryTree_rank(BinaryTree * self, PyObject * key,
+				Py_ssize_t * rank);
+static PyObject * BinaryTree_countRange(BinaryTree * self, PyObject * args);
+static PyObject * BinaryTree_histogram(BinaryTree * self, PyObject * arg);
+static PyObject * BinaryTree_removeRange(BinaryTree * self, PyObject * args);
+static int BinaryTree_insertItem(BinaryTree * self, PyObject * item);
+static int BinaryTree_find(BinaryTree * self, PyObject * target,
+				Node ** found);
+static int BinaryTree_removeItem(BinaryTree * self, PyObject * target);
+static PyObject * BinaryTree_unlinkNode(BinaryTree * self, NodeStack * path,
+					Node * rm);
+static void BinaryTree_discardNodes(BinaryTree * self);
+static Py_ssize_t BinaryTree_height(BinaryTree * self);
+static int BinaryTree_purge(BinaryTree * self);
+static PyObject * BinaryTree_bury(BinaryTree * self, NodeStack * path,
+					Node * node);
+static void BinaryTree_prune(BinaryTree * self);
+static int BinaryTree_encode(BinaryTree * self, PyObject * item, Key * key);
+static void BinaryTree_releaseKey(BinaryTree * self, Key * key);
+static int BinaryTree_compareNode(BinaryTree * self, Node * node,
+					PyObject * item, Key * key,
+					int * result);
+static PyObject * BinaryTree_keyType(BinaryTree * self);
+
+/* Prototypes for SubtreeType methods */
+static PyObject * Subtree_new(BinaryTree * tree, Node * root);
+static void Subtree_dealloc(Subtree * self);
+static int Subtree_traverse(Subtree * self, visitproc visit, void * arg);
+static int Subtree_clear(Subtree * self);
+static int Subtree_contains(Subtree * self, PyObject * value);
 
 /* Prototypes for Subtree methods */
+static PyObject * Subtree_root(Subtree * self);
+static PyObject * Subtree_locate(Subtree * self, PyObject * target);
+static PyObject * Subtree_inOrder(Subtree * self, PyObject * func);
+static PyObject * Subtree_preOrder(Subtree * self, PyObject * func);
+static PyObject * Subtree_postOrder(Subtree * self, PyObject * func);
 static PyObject * Subtree_maketree(Subtree * self);
 
+/* Prototypes for CursorType methods */
+static void Cursor_dealloc(Cursor * self);
+static int Cursor_traverse(Cursor * self, visitproc visit, void * arg);
+static int Cursor_clear(Cursor * self);
+
+/* Prototypes for Cursor methods */
+static int Cursor_seek(Cursor * self, PyObject * key);
+static PyObject * Cursor_new(BinaryTree * tree, PyTypeObject * type,
+				PyObject * key);
+static void Cursor_step(Cursor * self, int forward);
+static PyObject * Cursor_move(Cursor * self, int forward);
+static PyObject * Cursor_iternext(Cursor * self);
+static PyObject * Cursor_next(Cursor * self);
+static PyObject * Cursor_prev(Cursor * self);
+static PyObject * Cursor_item(Cursor * self);
+static PyObject * Cursor_remove(Cursor * self);
+static PyObject * Cursor_bury(Cursor * self);
+
 /* Left and right rotation */
-static Node * rotateLeft(Node * root);
-static Node * rotateRight(Node * root);
+static Node * rotateLeft(NodeLayout * layout, Node * root);
+static Node * rotateRight(NodeLayout * layout, Node * root);
+
+/* Rebalancing along a path */
+static void Node_relink(NodeLayout * layout, Node ** root, Node * parent,
+				Node * old, Node * new);
+static Node * Node_rebalance(NodeLayout * layout, Node * node);
+static void Node_retrace(NodeLayout * layout, Node ** root,
+				NodeStack * path);
+static void Node_avlInserted(BinaryTree * tree, NodeStack * path);
+static void Node_avlRemoved(BinaryTree * tree, NodeStack * path);
+static void Node_wavlInserted(BinaryTree * tree, NodeStack * path);
+static void Node_wavlRemoved(BinaryTree * tree, NodeStack * path);
+static void Node_splayPath(NodeLayout * layout, Node ** root,
+				NodeStack * path, int semi);
+static void Node_splay(BinaryTree * tree, NodeStack * path);
+static void Node_semiSplay(BinaryTree * tree, NodeStack * path);
+static void Node_retraceHeights(NodeLayout * layout, NodeStack * path,
+					Py_ssize_t i);
+static void Node_treapInserted(BinaryTree * tree, NodeStack * path);
+static void Node_treapRemoved(BinaryTree * tree, NodeStack * path);
+static unsigned int treapPriority(int height);
+static void Node_splitBefore(NodeLayout * layout, NodeStack * path,
+				Node ** left, Node ** right);
+static Node * Node_merge(NodeLayout * layout, Node * left, Node * right,
+				NodeStack * spine);
+static void Node_scapegoatInserted(BinaryTree * tree, NodeStack * path);
+static void Node_scapegoatRemoved(BinaryTree * tree, NodeStack * path);
+static Py_ssize_t scapegoatDepth(Py_ssize_t n);
+static const Balancer * findBalancer(const char * name);
+
+static void Node_updateHeight(NodeLayout * layout, Node * node);
+
+/* Item comparison and sorting */
+static int compareItems(PyObject * a, PyObject * b, int * result);
+static int sortItems(PyObject ** items, Py_ssize_t n);
+
+/* Handle validation */
+static int checkEpoch(BinaryTree * tree, Py_ssize_t epoch);
+static int checkVersion(BinaryTree * tree, Py_ssize_t version);
+static int checkCounts(BinaryTree * tree);
+static int checkQuantile(double q);
+
+/* Key encoding */
+static const KeyType * findKeyType(const char * name);
+static int ByteBuffer_append(ByteBuffer * buffer, const void * data,
+				Py_ssize_t n);
+static int encodeField(ByteBuffer * buffer, PyObject * item);
+static int encodeMemcmp(PyObject * item, void * key);
+static int compareMemcmp(const void * a, const void * b);
+static unsigned PY_LONG_LONG loadWord(const unsigned char * bytes);
+static int encodeBytes(PyObject * item, void * key, Py_ssize_t size);
+static int compareWords(const void * a, const void * b, int words);
+static int encodeBytes16(PyObject * item, void * key);
+static int compareBytes16(const void * a, const void * b);
+static int encodeBytes32(PyObject * item, void * key);
+static int compareBytes32(const void * a, const void * b);
+static int encodeDatetime(PyObject * item, void * key);
+static int encodeInt64(PyObject * item, void * key);
+static int compareInt64(const void * a, const void * b);
+static int radixSort(KeyedItem * items, Py_ssize_t n);
+static int BinaryTree_sortIntegers(BinaryTree * self, PyObject ** items,
+					Py_ssize_t n, PY_LONG_LONG ** keys);
+static int compareBatch(PyObject * a, PY_LONG_LONG * ka, PyObject * b,
+			PY_LONG_LONG * kb, int * result);
+
+/* Random sampling */
+static unsigned PY_LONG_LONG nextRandom(unsigned PY_LONG_LONG * state);
+static Py_ssize_t randomBelow(unsigned PY_LONG_LONG * state, Py_ssize_t n);
+static int rankSetAdd(Py_ssize_t * table, Py_ssize_t mask, Py_ssize_t rank);
+
+/* The key types, for trees that encode their items into keys */
+static const KeyType key_types[] = {
+	{"memcmp", NODE_KEYS | NODE_OBJECT_KEYS, sizeof(PyObject *),
+		encodeMemcmp, compareMemcmp, 0, NULL},
+	{"bytes16", NODE_KEYS, 16, encodeBytes16, compareBytes16, 0, NULL},
+	{"bytes32", NODE_KEYS, 32, encodeBytes32, compareBytes32, 0, NULL},
+	{"datetime", NODE_KEYS, sizeof(PY_LONG_LONG),
+		encodeDatetime, compareInt64, 1,
+		"can't mix offset-naive and offset-aware datetimes"},
+	{"int64", NODE_KEYS, sizeof(PY_LONG_LONG),
+		encodeInt64, compareInt64, 1, NULL},
+	{NULL}, /* Sentinel */
+};
 
-static void Node_updateHeight(Node * node);
+/* The balancing schemes, the first being the default */
+static const Balancer balancers[] = {
+	{"avl", NODE_HEIGHTS, Node_avlInserted, Node_avlRemoved, NULL},
+	{"wavl", NODE_HEIGHTS, Node_wavlInserted, Node_wavlRemoved, NULL},
+	{"splay", NODE_HEIGHTS, Node_splay, Node_splay, Node_splay},
+	{"semisplay", NODE_HEIGHTS, Node_semiSplay, Node_semiSplay,
+		Node_semiSplay},
+	{"treap", NODE_PRIORITIES | NODE_HEIGHTS, Node_treapInserted,
+		Node_treapRemoved, NULL},
+	{"scapegoat", 0, Node_scapegoatInserted, Node_scapegoatRemoved, NULL},
+	{NULL}, /* Sentinel */
+};
 
 static PyTypeObject NodeType = {
 	PyObject_HEAD_INIT(NULL)
@@ -134,7 +719,7 @@ static PyGetSetDef Node_getsetters[] = {
 };
 
 static PyMemberDef Node_members[] = {
-	{"item", T_OBJECT_EX, offsetof(Node, item), READONLY,
+	{"item", T_OBJECT_EX, offsetof(NodeObject, item), READONLY,
 	"The item kept by this node.",
 	},
 	{NULL}, /* Sentinel */
@@ -163,12 +748,91 @@ static PyMethodDef BinaryTree_methods[] = {
 	{"post_order", (PyCFunction) BinaryTree_postOrder, METH_O,
 	"post_order(callable) -> apply 'callable' to each item, post-order."
 	},
+	{"apply_batch", (PyCFunction) BinaryTree_applyBatch, METH_VARARGS,
+	"apply_batch(inserts, removes) -> insert and remove many items at once.\n"
+	"Items present in both sequences end up removed. If any comparison\n"
+	"fails, the tree is left unchanged."
+	},
+	{"clear", (PyCFunction) BinaryTree_clearNodes, METH_NOARGS,
+	"Removes all items from the tree at once."
+	},
+	{"reserve", (PyCFunction) BinaryTree_reserve, METH_O,
+	"reserve(n) -> make room for n more items without further allocations."
+	},
+	{"cursor", (PyCFunction) BinaryTree_cursor, METH_VARARGS,
+	"cursor([key]) -> a Cursor at the first item not less than 'key', or\n"
+	"at the first item of the tree."
+	},
+	{"page", (PyCFunction) BinaryTree_page, METH_VARARGS | METH_KEYWORDS,
+	"page(limit, after=None) -> (items, next), with up to 'limit' items\n"
+	"greater than 'after', or from the start. 'next' is the 'after' of the\n"
+	"following page, or None if there are no more items."
+	},
+	{"smallest", (PyCFunction) BinaryTree_smallest, METH_O,
+	"smallest(k) -> list of the k smallest items, in ascending order."
+	},
+	{"largest", (PyCFunction) BinaryTree_largest, METH_O,
+	"largest(k) -> list of the k largest items, in descending order."
+	},
+	{"sample", (PyCFunction) BinaryTree_sample,
+	METH_VARARGS | METH_KEYWORDS,
+	"sample(k, seed=None, replace=False) -> list of k random items.\n"
+	"Without replacement, the items are distinct. An integer seed makes\n"
+	"the sample reproducible."
+	},
+	{"quantile", (PyCFunction) BinaryTree_quantile, METH_O,
+	"quantile(q) -> the item at quantile q, between 0 and 1, by the\n"
+	"nearest-rank method: quantile(0.5) is the lower median."
+	},
+	{"quantiles", (PyCFunction) BinaryTree_quantiles, METH_O,
+	"quantiles(qs) -> list of the items at each quantile in 'qs'."
+	},
+	{"count_range", (PyCFunction) BinaryTree_countRange, METH_VARARGS,
+	"count_range(lo, hi) -> number of items not less than 'lo' and less\n"
+	"than 'hi'."
+	},
+	{"remove_range", (PyCFunction) BinaryTree_removeRange, METH_VARARGS,
+	"remove_range(lo, hi) -> number of items not less than 'lo' and less\n"
+	"than 'hi' removed from the tree."
+	},
+	{"histogram", (PyCFunction) BinaryTree_histogram, METH_O,
+	"histogram(boundaries) -> list of the number of items below the first\n"
+	"boundary, between each pair of consecutive boundaries, and from the\n"
+	"last boundary on. Boundaries must be in ascending order."
+	},
+	{"shrink", (PyCFunction) BinaryTree_shrink, METH_NOARGS,
+	"Compacts the tree's nodes, returning unused memory.\n"
+	"Nodes and Subtrees obtained before are invalidated."
+	},
+	{"rebuild", (PyCFunction) BinaryTree_rebuild,
+	METH_VARARGS | METH_KEYWORDS,
+	"rebuild(compact=False) -> relink the nodes into a tree of the least\n"
+	"height, without comparisons. With 'compact', they are then shrunk."
+	},
 	{NULL}, /* Sentinel */
 };
 
-static PyMemberDef BinaryTree_members[] = {
-	{"root", T_OBJECT, offsetof(BinaryTree, root), READONLY,
-	"Root of the tree.",
+static PyGetSetDef BinaryTree_getsetters[] = {
+	{"root",
+	(getter) BinaryTree_root,
+	NULL,
+	"Root of the tree. A removed node left as a tombstone has None\n"
+	"for its item."
+	},
+	{"capacity",
+	(getter) BinaryTree_capacity,
+	NULL,
+	"Number of items the tree can hold without allocating memory."
+	},
+	{"balance",
+	(getter) BinaryTree_balance,
+	NULL,
+	"Name of the balancing scheme of the tree."
+	},
+	{"key_type",
+	(getter) BinaryTree_keyType,
+	NULL,
+	"Name of the encoding of items into keys, or None."
 	},
 	{NULL}, /* Sentinel */
 };
@@ -180,16 +844,16 @@ static PyTypeObject SubtreeType = {
 };
 
 static PyMethodDef Subtree_methods[] = {
-	{"locate", (PyCFunction) BinaryTree_locate, METH_O,
+	{"locate", (PyCFunction) Subtree_locate, METH_O,
 	"The Node that contains the parameter if it is in the tree, or None."
 	},
-	{"in_order", (PyCFunction) BinaryTree_inOrder, METH_O,
+	{"in_order", (PyCFunction) Subtree_inOrder, METH_O,
 	"in_order(callable) -> apply 'callable' to each node, in-order."
 	},
-	{"pre_order", (PyCFunction) BinaryTree_preOrder, METH_O,
+	{"pre_order", (PyCFunction) Subtree_preOrder, METH_O,
 	"pre_order(callable) -> apply 'callable' to each node, pre-order."
 	},
-	{"post_order", (PyCFunction) BinaryTree_postOrder, METH_O,
+	{"post_order", (PyCFunction) Subtree_postOrder, METH_O,
 	"post_order(callable) -> apply 'callable' to each item, post-order."
 	},
 	{"make_tree", (PyCFunction) Subtree_maketree, METH_NOARGS,
@@ -198,35 +862,131 @@ static PyMethodDef Subtree_methods[] = {
 	{NULL}, /* Sentinel */
 };
 
-/* Returns the left subtree of a given node, as a new reference */
-static BinaryTree * Node_lchild(Node * self) {
-	BinaryTree * subtree;
+static PyGetSetDef Subtree_getsetters[] = {
+	{"root",
+	(getter) Subtree_root,
+	NULL,
+	"Root of the subtree. A removed node left as a tombstone has None\n"
+	"for its item."
+	},
+	{NULL}, /* Sentinel */
+};
 
-	subtree = PyObject_GC_New(Subtree, &SubtreeType);
-	if ( subtree == NULL ) return NULL;
+static PySequenceMethods Subtree_sequence;
 
-	Py_XINCREF(self->lchild);
-	subtree->root = self->lchild;
-	PyObject_GC_Track((PyObject *) subtree);
+static PyTypeObject CursorType = {
+	PyObject_HEAD_INIT(NULL)
+};
+
+static PyTypeObject IteratorType = {
+	PyObject_HEAD_INIT(NULL)
+};
+
+static PyMethodDef Cursor_methods[] = {
+	{"next", (PyCFunction) Cursor_next, METH_NOARGS,
+	"Moves to the next item. Returns False if there was none."
+	},
+	{"prev", (PyCFunction) Cursor_prev, METH_NOARGS,
+	"Moves to the previous item. Returns False if there was none."
+	},
+	{"remove", (PyCFunction) Cursor_remove, METH_NOARGS,
+	"Removes the current item from the tree, moving to the next one."
+	},
+	{NULL}, /* Sentinel */
+};
+
+static PyGetSetDef Cursor_getsetters[] = {
+	{"item",
+	(getter) Cursor_item,
+	NULL,
+	"The item at the cursor."
+	},
+	{NULL}, /* Sentinel */
+};
+
+/* Checks that no nodes of 'tree' have been released since 'epoch'.
+ * Returns 0 if so, -1 (with RuntimeError set) otherwise.
+ */
+static int checkEpoch(BinaryTree * tree, Py_ssize_t epoch) {
+	if ( tree->epoch == epoch ) return 0;
 
-	return subtree;
+	PyErr_SetString(PyExc_RuntimeError,
+		"nodes of the BinaryTree were released");
+	return -1;
 }
 
-/* Returns the right subtree of a given node, as a new reference */
-static BinaryTree * Node_rchild(Node * self) {
-	BinaryTree * subtree;
+/* Checks that 'tree' hasn't changed since 'version'.
+ * Returns 0 if so, -1 (with RuntimeError set) otherwise.
+ */
+static int checkVersion(BinaryTree * tree, Py_ssize_t version) {
+	if ( tree->version == version ) return 0;
 
-	subtree = PyObject_GC_New(Subtree, &SubtreeType);
-	if ( subtree == NULL ) return NULL;
+	PyErr_SetString(PyExc_RuntimeError,
+		"BinaryTree changed during iteration");
+	return -1;
+}
 
-	Py_XINCREF(self->rchild);
-	subtree->root = self->rchild;
-	PyObject_GC_Track((PyObject *) subtree);
+/* Checks that the nodes of 'tree' keep the size of their subtrees.
+ * Returns 0 if so, -1 (with TypeError set) otherwise.
+ */
+static int checkCounts(BinaryTree * tree) {
+	if ( tree->pool.layout.count != 0 ) return 0;
+
+	PyErr_SetString(PyExc_TypeError,
+		"the BinaryTree was created with sizes=False");
+	return -1;
+}
+
+/* Checks that 'q' is a valid quantile, between 0 and 1.
+ * Returns 0 if so, -1 (with ValueError set) otherwise.
+ */
+static int checkQuantile(double q) {
+	if ( q >= 0.0 && q <= 1.0 ) return 0;
+
+	PyErr_SetString(PyExc_ValueError, "quantile must be between 0 and 1");
+	return -1;
+}
+
+/* Returns a Node handle to 'node' of 'tree' as a new reference, None if
+ * 'node' is NULL, or NULL on failure.
+ */
+static PyObject * Node_wrap(BinaryTree * tree, Node * node) {
+	NodeObject * handle;
+
+	if ( node == NULL ) Py_RETURN_NONE;
+
+	handle = PyObject_GC_New(NodeObject, &NodeType);
+	if ( handle == NULL ) return NULL;
+
+	Py_INCREF(tree);
+	handle->tree = tree;
+	handle->node = node;
+	handle->epoch = tree->epoch;
+
+	/* Tombstones still lead to their children, but hold no item */
+	handle->item = NODE_IS_DEAD(&tree->pool.layout, node) ?
+				Py_None : node->item;
+	Py_INCREF(handle->item);
+	PyObject_GC_Track((PyObject *) handle);
+
+	return (PyObject *) handle;
+}
+
+/* Returns the left subtree of a given node, as a new reference */
+static PyObject * Node_lchild(NodeObject * self) {
+	if ( checkEpoch(self->tree, self->epoch) < 0 ) return NULL;
+
+	return Subtree_new(self->tree, self->node->lchild);
+}
+
+/* Returns the right subtree of a given node, as a new reference */
+static PyObject * Node_rchild(NodeObject * self) {
+	if ( checkEpoch(self->tree, self->epoch) < 0 ) return NULL;
 
-	return subtree;
+	return Subtree_new(self->tree, self->node->rchild);
 }
 
-static void Node_dealloc(Node * self) {
+static void Node_dealloc(NodeObject * self) {
 	PyObject_GC_UnTrack(self);
 	Node_clear(self);
 
@@ -235,42 +995,193 @@ static void Node_dealloc(Node * self) {
 	return;
 }
 
-static int Node_traverse(Node * self, visitproc visit, void * arg) {
+static int Node_traverse(NodeObject * self, visitproc visit, void * arg) {
 	Py_VISIT(self->item);
-	Py_VISIT((PyObject *) self->lchild);
-	Py_VISIT((PyObject *) self->rchild);
+	Py_VISIT((PyObject *) self->tree);
 
 	return 0;
 }
 
-static void Node_clear(Node * self) {
+static int Node_clear(NodeObject * self) {
 	Py_CLEAR(self->item);
+	Py_CLEAR(self->tree);
+
+	return 0;
+}
+
+/* Returns a Subtree view of the nodes below 'root' in 'tree', as a new
+ * reference.
+ */
+static PyObject * Subtree_new(BinaryTree * tree, Node * root) {
+	Subtree * subtree;
+
+	subtree = PyObject_GC_New(Subtree, &SubtreeType);
+	if ( subtree == NULL ) return NULL;
+
+	Py_INCREF(tree);
+	subtree->tree = tree;
+	subtree->root = root;
+	subtree->epoch = tree->epoch;
+	PyObject_GC_Track((PyObject *) subtree);
+
+	return (PyObject *) subtree;
+}
+
+static void Subtree_dealloc(Subtree * self) {
+	PyObject_GC_UnTrack(self);
+	Subtree_clear(self);
 
-	Py_CLEAR(self->lchild);
-	Py_CLEAR(self->rchild);
+	Py_TYPE((PyObject *) self)->tp_free((PyObject *) self);
 
 	return;
 }
 
+static int Subtree_traverse(Subtree * self, visitproc visit, void * arg) {
+	Py_VISIT((PyObject *) self->tree);
+
+	return 0;
+}
+
+static int Subtree_clear(Subtree * self) {
+	Py_CLEAR(self->tree);
+
+	return 0;
+}
+
+static int Subtree_contains(Subtree * self, PyObject * value) {
+	Node * found;
+
+	if ( checkEpoch(self->tree, self->epoch) < 0 ||
+		Node_find(self->tree, self->root, value, &found) < 0 )
+		return -1;
+
+	return ( found != NULL );
+}
+
+/* Creates an empty tree, with nodes in the default layout */
+static PyObject * BinaryTree_new(PyTypeObject * type, PyObject * args,
+					PyObject * kwds) {
+	BinaryTree * self;
+
+	self = (BinaryTree *) PyType_GenericNew(type, args, kwds);
+	if ( self == NULL ) return NULL;
+
+	NodeLayout_init(&self->pool.layout,
+			NODE_PARENTS | NODE_COUNTS | NODE_HEIGHTS, 0);
+	self->balancer = &balancers[0];
+
+	return (PyObject *) self;
+}
+
 static int BinaryTree_init(BinaryTree * t, PyObject * args, PyObject * kwds) {
-	PyObject * elements = NULL, * iter, * item;
+	static char * kwlist[] = {"iterable", "parents", "sizes", "balance",
+					"tombstones", "key_type", NULL};
+	PyObject * elements = NULL, * options[2] = {NULL, NULL};
+	PyObject * iter, * item, * fraction = NULL, * key_type = NULL;
+	static const int option_fields[2] = {NODE_PARENTS, NODE_COUNTS};
+	const Balancer * balancer = t->balancer;
+	const KeyType * keys = t->keys;
+	const char * balance = NULL;
+	double tombstones = t->tombstones;
+	int fields = t->pool.layout.fields, flag, i;
+	size_t keysize;
+
+	if (! PyArg_ParseTupleAndKeywords(args, kwds, "|OOOsOO:BinaryTree",
+					kwlist, &elements, &options[0],
+					&options[1], &balance, &fraction,
+					&key_type) ) {
+		return -1;
+	}
+
+	if ( key_type == Py_None ) {
+		keys = NULL;
+	} else if ( key_type != NULL ) {
+		if (! PyString_Check(key_type) ) {
+			PyErr_SetString(PyExc_TypeError,
+				"key_type must be a string or None");
+			return -1;
+		}
 
-	if ( kwds != NULL ) {
-		PyErr_SetString(PyExc_TypeError,
-		"BinaryTree initializer does not accept keyword arguments");
+		keys = findKeyType(PyString_AS_STRING(key_type));
+		if ( keys == NULL ) return -1;
+	}
+
+	if ( keys != t->keys && t->root != NULL ) {
+		PyErr_SetString(PyExc_ValueError,
+			"cannot change the key type of a BinaryTree "
+			"that has items");
 		return -1;
 	}
 
-	if (! PyArg_ParseTuple(args, "|O", &elements) ) {
+	if ( fraction != NULL ) {
+		tombstones = PyFloat_AsDouble(fraction);
+		if ( tombstones == -1.0 && PyErr_Occurred() != NULL )
+			return -1;
+
+		if (! (tombstones >= 0.0 && tombstones < 1.0) ) {
+			PyErr_SetString(PyExc_ValueError,
+				"tombstones must be at least 0 and less than 1");
+			return -1;
+		}
+
+		fields = (tombstones > 0.0) ? (fields | NODE_TOMBSTONES) :
+				(fields & ~NODE_TOMBSTONES);
+	}
+
+	if ( balance != NULL ) {
+		balancer = findBalancer(balance);
+		if ( balancer == NULL ) return -1;
+	}
+
+	if ( balancer != t->balancer && t->root != NULL ) {
+		PyErr_SetString(PyExc_ValueError,
+			"cannot change the balancing of a BinaryTree "
+			"that has items");
 		return -1;
 	}
 
+	/* Options left out keep their current setting */
+	for ( i = 0; i < 2; i++ ) {
+		if ( options[i] == NULL ) continue;
+
+		flag = PyObject_IsTrue(options[i]);
+		if ( flag < 0 ) return -1;
+
+		fields = flag ? (fields | option_fields[i]) :
+				(fields & ~option_fields[i]);
+	}
+
+	fields = (fields & ~NODE_BALANCER_FIELDS) | balancer->fields;
+	fields = (fields & ~NODE_KEY_FIELDS) |
+			((keys != NULL) ? keys->fields : 0);
+	keysize = (keys != NULL) ? keys->size : 0;
+
+	if ( fields != t->pool.layout.fields ||
+		keysize != t->pool.layout.keysize ) {
+		if ( t->pool.arenas != NULL ) {
+			PyErr_SetString(PyExc_ValueError,
+			"cannot change the node layout of a BinaryTree "
+			"that has nodes");
+			return -1;
+		}
+
+		NodeLayout_init(&t->pool.layout, fields, keysize);
+	}
+
+	t->balancer = balancer;
+	t->keys = keys;
+	t->tombstones = tombstones;
+
+	/* Integer keys are radix sorted and built into a tree at once */
+	if ( elements && keys != NULL && keys->integers )
+		return BinaryTree_apply(t, elements, NULL);
+
 	if ( elements ) {
 		iter = PyObject_GetIter(elements);
 		if (! iter ) return -1;
 
 		while ( (item = PyIter_Next(iter)) != NULL ) {
-			if (! BinaryTree_insert(t, item) ) {
+			if ( BinaryTree_insertItem(t, item) < 0 ) {
 				Py_DECREF(item);
 				Py_DECREF(iter);
 				return -1;
@@ -278,9 +1189,12 @@ static int BinaryTree_init(BinaryTree * t, PyObject * args, PyObject * kwds) {
 
 			Py_DECREF(item);
 		}
+
+		Py_DECREF(iter);
+		if ( PyErr_Occurred() != NULL ) return -1;
 	}
 
-	return 1;
+	return 0;
 }
 
 static void BinaryTree_dealloc(BinaryTree * self) {
@@ -291,30 +1205,40 @@ static void BinaryTree_dealloc(BinaryTree * self) {
 	return;
 }
 
+/* Visits every item in the tree. The nodes are found by scanning the arenas,
+ * which is cheaper than walking the tree.
+ */
 static int BinaryTree_traverse(BinaryTree * self, visitproc visit, void * arg) {
-	Py_VISIT(self->root);
+	NodeArena * arena;
+	Py_ssize_t i;
+
+	for ( arena = self->pool.arenas; arena != NULL; arena = arena->next ) {
+		for ( i = 0; i < arena->used; i++ )
+			Py_VISIT(NODEARENA_NODE(arena, i)->item);
+	}
 
 	return 0;
 }
 
-static void BinaryTree_clear(BinaryTree * self) {
-	Py_CLEAR(self->root);
+static int BinaryTree_clear(BinaryTree * self) {
+	BinaryTree_discardNodes(self);
 
-	return;
+	return 0;
 }
 
 static int BinaryTree_contains(BinaryTree * self, PyObject * value) {
-	PyObject * res;
+	Node * found;
 
-	res = BinaryTree_locate(self, value);
-	if ( res == NULL ) return -1;
+	releasePending();
+
+	if ( BinaryTree_find(self, value, &found) < 0 ) return -1;
 
-	return ( res == Py_None ) ? 0 : 1;
+	return ( found != NULL );
 }
 
 /* Rotates the subtree starting at 'root' to the left.
  * Returns the new root */
-static Node * rotateLeft(Node * root) {
+static Node * rotateLeft(NodeLayout * layout, Node * root) {
 	Node * newroot;
 
 	if ( root == NULL ) return NULL;
@@ -322,13 +1246,20 @@ static Node * rotateLeft(Node * root) {
 
 	if ( newroot ) {
 		root->rchild = newroot->lchild;
-		Node_updateHeight(root);
+		NODE_SET_PARENT(layout, root->rchild, root);
+		Node_updateHeight(layout, root);
 
 		newroot->lchild = root;
-		Node_updateHeight(newroot);
+		if ( layout->parent != 0 ) {
+			NODE_PARENT(layout, newroot) = NODE_PARENT(layout, root);
+			NODE_PARENT(layout, root) = newroot;
+		}
+		Node_updateHeight(layout, newroot);
 
-		NODE_UPDATE_BALANCE(root);
-		NODE_UPDATE_BALANCE(newroot);
+		NODE_UPDATE_BALANCE(layout, root);
+		NODE_UPDATE_BALANCE(layout, newroot);
+		NODE_UPDATE_COUNT(layout, root);
+		NODE_UPDATE_COUNT(layout, newroot);
 
 		return newroot;
 	}
@@ -339,7 +1270,7 @@ static Node * rotateLeft(Node * root) {
 
 /* Rotates the subtree starting at 'root' to the right.
  * Returns the new root. */
-static Node * rotateRight(Node * root) {
+static Node * rotateRight(NodeLayout * layout, Node * root) {
 	Node * newroot;
 
 	if ( root == NULL ) return NULL;
@@ -347,13 +1278,20 @@ static Node * rotateRight(Node * root) {
 
 	if ( newroot ) {
 		root->lchild = newroot->rchild;
-		Node_updateHeight(root);
+		NODE_SET_PARENT(layout, root->lchild, root);
+		Node_updateHeight(layout, root);
 
 		newroot->rchild = root;
-		Node_updateHeight(newroot);
+		if ( layout->parent != 0 ) {
+			NODE_PARENT(layout, newroot) = NODE_PARENT(layout, root);
+			NODE_PARENT(layout, root) = newroot;
+		}
+		Node_updateHeight(layout, newroot);
 
-		NODE_UPDATE_BALANCE(root);
-		NODE_UPDATE_BALANCE(newroot);
+		NODE_UPDATE_BALANCE(layout, root);
+		NODE_UPDATE_BALANCE(layout, newroot);
+		NODE_UPDATE_COUNT(layout, root);
+		NODE_UPDATE_COUNT(layout, newroot);
 
 		return newroot;
 	}
@@ -361,506 +1299,4560 @@ static Node * rotateRight(Node * root) {
 	return root;
 }
 
-static void Node_updateHeight(Node * node) {
+static void Node_updateHeight(NodeLayout * layout, Node * node) {
 	int lheight, rheight;
 
-	if ( node == NULL ) return;
+	if ( node == NULL || layout->height == 0 ) return;
 
-	lheight = node->lchild ? node->lchild->height : 0;
-	rheight = node->rchild ? node->rchild->height : 0;
+	lheight = NODE_SUBTREE_HEIGHT(layout, node->lchild);
+	rheight = NODE_SUBTREE_HEIGHT(layout, node->rchild);
 
-	node->height = 1 + ((lheight > rheight) ? lheight : rheight);
+	NODE_HEIGHT(layout, node) = 1 +
+		((lheight > rheight) ? lheight : rheight);
 
 	return;
 }
 
-/* Creates and returns an empty leaf node.
- * Returns a new reference.
- */
-static Node * Node_new(void) {
-	Node * newnode;
-
-	newnode = PyObject_GC_New(Node, &NodeType);
-	if ( newnode == NULL ) return NULL;
+static void NodeStack_init(NodeStack * stack) {
+	stack->nodes = stack->prealloc;
+	stack->len = 0;
+	stack->allocated = NODESTACK_PREALLOC;
 
-	/* Initializing as a leaf */
-	NODE_SET_LEAF(newnode);
-
-	newnode->item = NULL;
+	return;
+}
 
-	PyObject_GC_Track(newnode);
+static void NodeStack_free(NodeStack * stack) {
+	if ( stack->nodes != stack->prealloc )
+		PyMem_Free(stack->nodes);
 
-	return newnode;
+	NodeStack_init(stack);
+	return;
 }
 
-/* Inserts 'new' into the tree whose root is 'root'.
- * Returns the new root of the tree, or NULL on failure.
- * Note: Assumes 'new' has been initialized as a leaf.
+/* Makes room for at least 'n' more nodes in the stack.
+ * Returns 0 on success, -1 on failure. Doesn't set an exception, so that
+ * it can be used while deallocating.
  */
-static Node * Node_insert(Node * root, Node * new) {
-	int child_height = 0;
-
-	if ( root == NULL ) {
-		assert(NODE_IS_LEAF(new));
-		return new;
+static int NodeStack_reserve(NodeStack * stack, Py_ssize_t n) {
+	Node ** grown;
+	Py_ssize_t allocated;
+
+	if ( stack->len + n <= stack->allocated ) return 0;
+
+	allocated = stack->allocated;
+	while ( allocated < stack->len + n )
+		allocated *= 2;
+
+	if ( stack->nodes == stack->prealloc ) {
+		grown = PyMem_New(Node *, allocated);
+		if ( grown != NULL )
+			memcpy(grown, stack->nodes, stack->len * sizeof(Node *));
+	} else {
+		grown = stack->nodes;
+		PyMem_Resize(grown, Node *, allocated);
 	}
 
-	switch ( PyObject_Compare(root->item, new->item) ) {
-		case 0:
-			return root; /* Node already in the tree */
-		case 1:
-			/* Descend left */
-			if ( root->lchild )
-				child_height = root->lchild->height;
+	if ( grown == NULL ) return -1;
 
-			if ( Py_EnterRecursiveCall(" in insertion") != 0 )
-				return NULL;
+	stack->nodes = grown;
+	stack->allocated = allocated;
 
-			root->lchild = Node_insert(root->lchild, new);
-			if ( root->lchild == NULL ) return NULL;
-			Py_LeaveRecursiveCall();
+	return 0;
+}
 
-			/* No change in height.
-			 * Either the insertion balanced the left subtree,
-			 * or there has already been a rebalancing somewhere
-			 * along the way up here.
-			 */
-			if ( child_height == root->lchild->height )
-				return root;
+/* Appends 'node' to the stack, growing it if needed.
+ * Returns 0 on success, -1 (with MemoryError set) on failure.
+ */
+static int NodeStack_push(NodeStack * stack, Node * node) {
+	if ( NodeStack_reserve(stack, 1) < 0 ) {
+		PyErr_NoMemory();
+		return -1;
+	}
 
-			assert(root->lchild->height == 1 + child_height);
+	stack->nodes[stack->len++] = node;
+	return 0;
+}
 
-			/* Fixing balance and height of the root */
-			Node_updateHeight(root);
-			NODE_UPDATE_BALANCE(root);
+#ifdef USE_HUGE_PAGES
+/* Maps 'size' bytes, rounded up to whole huge pages, at an address aligned
+ * to a huge page, and advises the kernel to back them with huge pages.
+ * The advice may be ignored, in which case the mapping is still usable.
+ * Returns NULL on failure.
+ */
+static void * mapHugePages(size_t size) {
+	char * base, * aligned;
+	size_t length;
 
-			/* Do we need to rebalance? */
-			if ( root->balance > -2 ) return root;
+	length = (size + NODEARENA_HUGE_PAGE - 1) & ~(NODEARENA_HUGE_PAGE - 1);
 
-			if ( root->lchild->balance == 1 ) {
-				/* Left-right case */
-				root->lchild = rotateLeft(root->lchild);
-			}
+	/* Over-allocate by a huge page, then trim both ends to alignment */
+	base = (char *) mmap(NULL, length + NODEARENA_HUGE_PAGE,
+			PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+			-1, 0);
+	if ( base == (char *) MAP_FAILED ) return NULL;
 
-			/* Left-left case */
-			return rotateRight(root);
+	aligned = (char *) (((Py_uintptr_t) base + NODEARENA_HUGE_PAGE - 1) &
+				~(Py_uintptr_t) (NODEARENA_HUGE_PAGE - 1));
 
-		case -1:
-			/* Descend right.
-			 * Symmetrical to the left case above.
-			 */
-			if ( root->rchild )
-				child_height = root->rchild->height;
+	if ( aligned != base )
+		munmap(base, aligned - base);
+	if ( aligned != base + NODEARENA_HUGE_PAGE )
+		munmap(aligned + length,
+			base + NODEARENA_HUGE_PAGE - aligned);
 
-			if ( Py_EnterRecursiveCall(" in insertion") != 0 )
-				return NULL;
+	madvise(aligned, length, MADV_HUGEPAGE);
 
-			root->rchild = Node_insert(root->rchild, new);
-			if ( root->rchild == NULL ) return NULL;
-			Py_LeaveRecursiveCall();
+	return aligned;
+}
+#endif
 
-			if ( child_height == root->rchild->height )
-				return root;
+/* Sets up the layout of nodes with the optional 'fields', and keys of
+ * 'keysize' bytes if they include NODE_KEYS.
+ */
+static void NodeLayout_init(NodeLayout * layout, int fields, size_t keysize) {
+	layout->fields = fields;
+	layout->size = sizeof(Node);
+	layout->parent = 0;
+	layout->count = 0;
+
+	layout->key = 0;
+	layout->keysize = 0;
+	if ( fields & NODE_KEYS ) {
+		layout->key = layout->size;
+		layout->keysize = keysize;
+		layout->size += (keysize + sizeof(void *) - 1) &
+				~(sizeof(void *) - 1);
+	}
 
-			assert(root->rchild->height == 1 + child_height);
+	if ( fields & NODE_PARENTS ) {
+		layout->parent = layout->size;
+		layout->size += sizeof(Node *);
+	}
 
-			Node_updateHeight(root);
-			NODE_UPDATE_BALANCE(root);
+	if ( fields & NODE_COUNTS ) {
+		layout->count = layout->size;
+		layout->size += sizeof(Py_ssize_t);
+	}
 
-			if ( root->balance < 2 ) return root;
+	layout->priority = 0;
+	if ( fields & NODE_PRIORITIES ) {
+		layout->priority = layout->size;
+		layout->size += sizeof(unsigned int);
+	}
 
-			if ( root->rchild->balance == -1 ) {
-				/* Right-left case */
-				root->rchild = rotateRight(root->rchild);
-			}
+	layout->height = 0;
+	if ( fields & NODE_HEIGHTS ) {
+		layout->height = layout->size;
+		layout->size += 2 * sizeof(int);
+	}
 
-			/* Right-Right case */
-			return rotateLeft(root);
+	layout->dead = 0;
+	if ( fields & NODE_TOMBSTONES ) {
+		layout->dead = layout->size;
+		layout->size += sizeof(int);
 	}
 
-	return NULL; /* Unexpected result in comparison */
+	/* Keep the nodes of an arena aligned */
+	layout->size = (layout->size + sizeof(void *) - 1) &
+			~(sizeof(void *) - 1);
+
+	return;
 }
 
-/* Removes the node that contains 'target' from tree whose
- * root is 'root'.
- * Returns the new root of the tree (which may be NULL).
+/* Allocates an arena with room for at least 'capacity' nodes laid out as
+ * in 'layout'.
+ * Returns NULL on failure, without setting an exception.
  */
-static Node * Node_remove(Node * root, PyObject * target) {
-	int child_height = 0, cmp;
-	Node * rm = NULL;
-	PyObject * tmp;
+static NodeArena * NodeArena_new(Py_ssize_t capacity, NodeLayout * layout) {
+	NodeArena * arena = NULL;
+	size_t size, mapped = 0, stride = layout->size;
 
-	if ( root == NULL ) return NULL;
+	if ( capacity > (PY_SSIZE_T_MAX - (Py_ssize_t) sizeof(NodeArena) -
+				(Py_ssize_t) NODEARENA_HUGE_PAGE) /
+				(Py_ssize_t) stride )
+		return NULL;
 
-	cmp = PyObject_Compare(root->item, target);
-	if ( cmp == 0 ) {
-		if ( NODE_IS_LEAF(root) ) {
-			/* Simple removal of a leaf */
-			Py_DECREF(root);
-			return NULL;
+	size = offsetof(NodeArena, nodes) + capacity * stride;
+
+#ifdef USE_HUGE_PAGES
+	if ( huge_pages && size > NODEARENA_HUGE_PAGE / 2 ) {
+		arena = (NodeArena *) mapHugePages(size);
+		if ( arena != NULL ) {
+			/* Use the whole mapping */
+			mapped = (size + NODEARENA_HUGE_PAGE - 1) &
+					~(NODEARENA_HUGE_PAGE - 1);
+			capacity = (mapped - offsetof(NodeArena, nodes)) /
+					stride;
 		}
+	}
+#endif
 
-		/* Is root a Node with only one child? */
-		if ( root->lchild != NULL ) {
-			if ( root->rchild == NULL )
-				rm = root->lchild;
-		} else {
-			if ( root->rchild != NULL )
-				rm = root->rchild;
-		}
+	if ( arena == NULL ) {
+		arena = (NodeArena *) PyMem_Malloc(size);
+		if ( arena == NULL ) return NULL;
+	}
 
-		if ( rm != NULL ) {
-			assert(NODE_IS_LEAF(rm));
+	arena->next = NULL;
+	arena->capacity = capacity;
+	arena->used = 0;
+	arena->mapped = mapped;
+	arena->stride = stride;
+	arena->keys = (layout->fields & NODE_OBJECT_KEYS) ? layout->key : 0;
 
-			/* Yes, copy the item from the child to
-			 * the root. */
-			Py_INCREF(rm->item);
-			root->item = rm->item;
+	return arena;
+}
 
-			/* Deleting the leaf. */
-			if ( rm == root->lchild )
-				Py_CLEAR(root->lchild);
-			else
-				Py_CLEAR(root->rchild);
+/* Frees 'arena', whose items must have been released */
+static void NodeArena_free(NodeArena * arena) {
+#ifdef USE_HUGE_PAGES
+	if ( arena->mapped != 0 ) {
+		munmap(arena, arena->mapped);
+		return;
+	}
+#endif
 
-			/* root becomes a leaf */
-			NODE_SET_LEAF(root);
+	PyMem_Free(arena);
+	return;
+}
 
-			return root;
-		}
+/* Adds an arena with room for 'capacity' nodes to the pool.
+ * The nodes left unused in the previous arena are moved to the free list,
+ * so that none are lost.
+ * Returns 0 on success, -1 (with MemoryError set) on failure.
+ */
+static int NodePool_grow(NodePool * pool, Py_ssize_t capacity) {
+	NodeArena * arena = pool->arenas, * new;
+	Node * node;
 
-		/* Root has both lchild and rchild */
-		rm = root->lchild;
-		while ( rm->rchild != NULL ) {
-			rm = rm->rchild;
-		}
+	new = NodeArena_new(capacity, &pool->layout);
+	if ( new == NULL ) {
+		PyErr_NoMemory();
+		return -1;
+	}
 
-		/* rm and root swap references */
-		tmp = rm->item;
-		rm->item = root->item;
-		root->item = tmp;
+	if ( arena != NULL ) {
+		while ( arena->used < arena->capacity ) {
+			node = NODEARENA_NODE(arena, arena->used++);
+			node->item = NULL;
+			node->lchild = NULL;
+			node->rchild = pool->free;
+			pool->free = node;
+		}
+	}
 
-		/* Fall through to left-descend */
-		cmp = 1;
+	new->next = pool->arenas;
+	pool->arenas = new;
+	pool->capacity += new->capacity;
 
-	} else { /* if ( cmp == 0 ) */
+	return 0;
+}
 
-		if ( cmp == -1 ) {
-			/* Descend right */
-			if ( root->rchild )
-				child_height = root->rchild->height;
+/* Makes sure the pool can hand out 'n' more nodes without allocating.
+ * Returns 0 on success, -1 (with MemoryError set) on failure.
+ */
+static int NodePool_reserve(NodePool * pool, Py_ssize_t n) {
+	Py_ssize_t available = pool->capacity - pool->size;
 
-			if ( Py_EnterRecursiveCall(" in removal") != 0 )
-				return NULL;
+	if ( n <= available ) return 0;
 
-			root->rchild = Node_remove(root->rchild, target);
-			if ( root->rchild == NULL && PyErr_Occurred() != NULL )
-				return NULL;
-			Py_LeaveRecursiveCall();
+	return NodePool_grow(pool, n - available);
+}
 
-			/* Fixing balance and height of the root */
-			Node_updateHeight(root);
-			NODE_UPDATE_BALANCE(root);
+/* Takes a node out of the pool, reusing released nodes first.
+ * Returns NULL (with MemoryError set) on failure.
+ */
+static Node * NodePool_alloc(NodePool * pool) {
+	NodeArena * arena = pool->arenas;
+	Node * node;
+	Py_ssize_t capacity;
+
+	if ( pool->free != NULL ) {
+		node = pool->free;
+		pool->free = node->rchild;
+	} else {
+		if ( arena == NULL || arena->used == arena->capacity ) {
+			capacity = NODEARENA_MIN_NODES;
+			if ( arena != NULL )
+				capacity = arena->capacity * 2;
+			if ( capacity > NODEARENA_MAX_NODES(pool->layout.size) )
+				capacity = NODEARENA_MAX_NODES(pool->layout.size);
+
+			if ( NodePool_grow(pool, capacity) < 0 ) return NULL;
+			arena = pool->arenas;
+		}
+
+		node = NODEARENA_NODE(arena, arena->used++);
+	}
+
+	pool->size++;
+	return node;
+}
+
+/* Returns 'node' to the pool. The caller is responsible for the node's item,
+ * which is dropped from the node without being released.
+ */
+static void NodePool_free(NodePool * pool, Node * node) {
+	/* Releasing a key runs no arbitrary code, unlike an item */
+	if ( pool->layout.fields & NODE_OBJECT_KEYS )
+		Py_CLEAR(NODE_KEY_OBJECT(&pool->layout, node));
+
+	node->item = NULL;
+	node->lchild = NULL;
+	node->rchild = pool->free;
+	pool->free = node;
+	pool->size--;
+
+	return;
+}
+
+/* Empties the pool, returning its list of arenas, whose items are still to
+ * be released.
+ */
+static NodeArena * NodePool_detach(NodePool * pool) {
+	NodeArena * arenas = pool->arenas;
+
+	pool->arenas = NULL;
+	pool->free = NULL;
+	pool->size = 0;
+	pool->capacity = 0;
+
+	return arenas;
+}
+
+/* Appends the list of 'arenas' to the queue */
+static void ReleaseQueue_push(ReleaseQueue * queue, NodeArena * arenas) {
+	if ( arenas == NULL ) return;
+
+	if ( queue->tail == NULL )
+		queue->head = arenas;
+	else
+		queue->tail->next = arenas;
+
+	while ( arenas->next != NULL )
+		arenas = arenas->next;
+
+	queue->tail = arenas;
+	return;
+}
+
+/* Releases the items in the queued arenas, at most 'budget' of them, or all
+ * of them if 'budget' is negative. Each arena is freed as a whole once it
+ * has been scanned.
+ * Returns the number of items released.
+ */
+static Py_ssize_t ReleaseQueue_release(ReleaseQueue * queue,
+					Py_ssize_t budget) {
+	NodeArena * arena;
+	Node * node;
+	PyObject * item;
+	Py_ssize_t released = 0;
+
+	if ( queue->busy ) return 0;
+	queue->busy = 1;
+
+	while ( queue->head != NULL && released != budget ) {
+		arena = queue->head;
+
+		while ( queue->index < arena->used && released != budget ) {
+			node = NODEARENA_NODE(arena, queue->index++);
+			item = node->item;
+			if ( item != NULL ) {
+				released++;
+				if ( arena->keys != 0 )
+					Py_XDECREF(*(PyObject **) ((char *) node +
+								arena->keys));
+				Py_DECREF(item);
+			}
+		}
+
+		if ( queue->index == arena->used ) {
+			queue->head = arena->next;
+			if ( queue->head == NULL ) queue->tail = NULL;
+			queue->index = 0;
+
+			NodeArena_free(arena);
+		}
+	}
+
+	queue->busy = 0;
+	return released;
+}
+
+/* Frees the next chunk of queued nodes, if any. Called at the start of
+ * tree operations, so that the cost of dropping a large tree is spread
+ * over many of them.
+ */
+static void releasePending(void) {
+	if ( pending_release.head != NULL ) {
+		ReleaseQueue_release(&pending_release,
+			release_chunk > 0 ? release_chunk : -1);
+	}
+
+	return;
+}
+
+/* Compares 'a' and 'b' as cmp() would, storing -1, 0 or 1 in 'result'.
+ * PyObject_Compare also uses -1 to signal errors, so this is the
+ * unambiguous way of telling a failed comparison apart.
+ * Returns 0 on success, -1 if the comparison raised.
+ */
+static int compareItems(PyObject * a, PyObject * b, int * result) {
+	int cmp;
+
+	cmp = PyObject_Compare(a, b);
+	if ( cmp == -1 && PyErr_Occurred() != NULL ) return -1;
+
+	*result = (cmp > 0) - (cmp < 0);
+	return 0;
+}
+
+/* Sorts 'items' in place with a stable, bottom-up merge sort, using the
+ * same comparison as the tree itself.
+ * Returns 0 on success, -1 on failure, in which case 'items' holds an
+ * arbitrary permutation of its original contents.
+ */
+static int sortItems(PyObject ** items, Py_ssize_t n) {
+	PyObject ** buffer, ** src, ** dst, ** tmp;
+	Py_ssize_t width, lo, mid, hi, i, j, k;
+	int cmp;
+
+	if ( n < 2 ) return 0;
+
+	buffer = PyMem_New(PyObject *, n);
+	if ( buffer == NULL ) {
+		PyErr_NoMemory();
+		return -1;
+	}
+
+	src = items;
+	dst = buffer;
+	for ( width = 1; width < n; width *= 2 ) {
+		for ( lo = 0; lo < n; lo += 2 * width ) {
+			mid = (lo + width < n) ? lo + width : n;
+			hi = (lo + 2 * width < n) ? lo + 2 * width : n;
+
+			i = lo;
+			j = mid;
+			k = lo;
+			while ( i < mid && j < hi ) {
+				if ( compareItems(src[j], src[i], &cmp) < 0 ) {
+					PyMem_Free(buffer);
+					return -1;
+				}
+
+				/* Only take from the right run when strictly
+				 * smaller, to keep the sort stable. */
+				dst[k++] = (cmp < 0) ? src[j++] : src[i++];
+			}
+
+			while ( i < mid ) dst[k++] = src[i++];
+			while ( j < hi ) dst[k++] = src[j++];
+		}
+
+		tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+
+	if ( src != items )
+		memcpy(items, src, n * sizeof(PyObject *));
+
+	PyMem_Free(buffer);
+	return 0;
+}
+
+/* Sorts 'items' by their keys with a stable LSD radix sort, a byte at a
+ * time, skipping the bytes all keys share, in O(n) for each other byte.
+ * Returns 0 on success, -1 (with MemoryError set) on failure.
+ */
+static int radixSort(KeyedItem * items, Py_ssize_t n) {
+	KeyedItem * buffer, * src, * dst, * tmp;
+	Py_ssize_t counts[256], total, count, i;
+	int shift, b;
+
+	if ( n < 2 ) return 0;
+
+	buffer = PyMem_New(KeyedItem, n);
+	if ( buffer == NULL ) {
+		PyErr_NoMemory();
+		return -1;
+	}
+
+	src = items;
+	dst = buffer;
+	for ( shift = 0; shift < 64; shift += 8 ) {
+		memset(counts, 0, sizeof(counts));
+		for ( i = 0; i < n; i++ )
+			counts[(src[i].key >> shift) & 0xFF]++;
+
+		if ( counts[(src[0].key >> shift) & 0xFF] == n ) continue;
+
+		for ( b = 0, total = 0; b < 256; b++ ) {
+			count = counts[b];
+			counts[b] = total;
+			total += count;
+		}
+
+		for ( i = 0; i < n; i++ )
+			dst[counts[(src[i].key >> shift) & 0xFF]++] = src[i];
+
+		tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+
+	if ( src != items )
+		memcpy(items, src, n * sizeof(KeyedItem));
+
+	PyMem_Free(buffer);
+	return 0;
+}
+
+/* Sorts 'items' by their keys, in trees whose key type has integer keys,
+ * storing the sorted keys in a new array in 'keys', which the caller
+ * frees with PyMem_Free.
+ * Returns 0 on success, -1 on failure, in which case 'items' may be in any
+ * order and 'keys' is NULL.
+ */
+static int BinaryTree_sortIntegers(BinaryTree * self, PyObject ** items,
+					Py_ssize_t n, PY_LONG_LONG ** keys) {
+	KeyedItem * sorted;
+	PY_LONG_LONG value;
+	Key key;
+	Py_ssize_t i;
+
+	sorted = PyMem_New(KeyedItem, n);
+	*keys = PyMem_New(PY_LONG_LONG, n);
+	if ( sorted == NULL || *keys == NULL ) {
+		PyErr_NoMemory();
+		goto fail;
+	}
+
+	for ( i = 0; i < n; i++ ) {
+		if ( BinaryTree_encode(self, items[i], &key) < 0 ) goto fail;
+
+		memcpy(&value, &key, sizeof(value));
+		sorted[i].key = (unsigned PY_LONG_LONG) value ^ (1ULL << 63);
+
+		/* An empty tree takes the kind of the batch's first key */
+		if ( self->keys->mixed != NULL &&
+			(sorted[i].key ^ sorted[0].key) & 1 ) {
+			PyErr_SetString(PyExc_TypeError, self->keys->mixed);
+			goto fail;
+		}
+		sorted[i].item = items[i];
+	}
+
+	if ( radixSort(sorted, n) < 0 ) goto fail;
+
+	for ( i = 0; i < n; i++ ) {
+		items[i] = sorted[i].item;
+		(*keys)[i] = (PY_LONG_LONG) (sorted[i].key ^ (1ULL << 63));
+	}
+
+	PyMem_Free(sorted);
+	return 0;
+
+fail:
+	PyMem_Free(sorted);
+	PyMem_Free(*keys);
+	*keys = NULL;
+	return -1;
+}
+
+/* Compares the batch items 'a' and 'b' by their integer keys 'ka' and
+ * 'kb', or as compareItems does if they have none.
+ * Returns 0 on success, -1 if the comparison raised.
+ */
+static int compareBatch(PyObject * a, PY_LONG_LONG * ka, PyObject * b,
+			PY_LONG_LONG * kb, int * result) {
+	if ( ka == NULL ) return compareItems(a, b, result);
+
+	*result = (*ka > *kb) - (*ka < *kb);
+	return 0;
+}
+
+/* Creates and returns an empty leaf node, taken from 'pool'.
+ * Returns NULL on failure.
+ */
+static Node * Node_new(NodePool * pool) {
+	Node * newnode;
+
+	newnode = NodePool_alloc(pool);
+	if ( newnode == NULL ) return NULL;
+
+	/* Initializing as a leaf */
+	NODE_SET_LEAF(&pool->layout, newnode);
+	NODE_SET_PARENT(&pool->layout, newnode, NULL);
+	if ( pool->layout.count != 0 ) NODE_COUNT(&pool->layout, newnode) = 1;
+	if ( pool->layout.dead != 0 ) NODE_DEAD(&pool->layout, newnode) = 0;
+	if ( pool->layout.key != 0 )
+		memset(NODE_KEY(&pool->layout, newnode), 0,
+			pool->layout.keysize);
+
+	newnode->item = NULL;
+
+	return newnode;
+}
+
+/* Makes 'new' take the place of 'old' as a child of 'parent', or as the
+ * root of the tree in '*root' if 'parent' is NULL.
+ */
+static void Node_relink(NodeLayout * layout, Node ** root, Node * parent,
+				Node * old, Node * new) {
+	if ( parent == NULL )
+		*root = new;
+	else if ( parent->lchild == old )
+		parent->lchild = new;
+	else
+		parent->rchild = new;
+
+	NODE_SET_PARENT(layout, new, parent);
+
+	return;
+}
+
+/* Restores the AVL property at 'node', whose height and balance must be
+ * up to date. Returns the new root of the subtree.
+ */
+static Node * Node_rebalance(NodeLayout * layout, Node * node) {
+	if ( NODE_BALANCE(layout, node) == -2 ) {
+		if ( NODE_BALANCE(layout, node->lchild) == 1 ) {
+			/* Left-right case */
+			node->lchild = rotateLeft(layout, node->lchild);
+		}
+
+		/* Left-left case */
+		return rotateRight(layout, node);
+	}
+
+	if ( NODE_BALANCE(layout, node) == 2 ) {
+		if ( NODE_BALANCE(layout, node->rchild) == -1 ) {
+			/* Right-left case */
+			node->rchild = rotateRight(layout, node->rchild);
+		}
+
+		/* Right-right case */
+		return rotateLeft(layout, node);
+	}
+
+	return node;
+}
+
+/* Walks 'path' bottom-up after the subtree below its last node changed
+ * height, fixing heights and balances and rotating where needed.
+ * Stops as soon as a subtree keeps its previous height.
+ */
+static void Node_retrace(NodeLayout * layout, Node ** root,
+				NodeStack * path) {
+	Py_ssize_t i;
+	Node * node, * subtree;
+	int height;
+
+	for ( i = path->len - 1; i >= 0; i-- ) {
+		node = path->nodes[i];
+		height = NODE_HEIGHT(layout, node);
+
+		Node_updateHeight(layout, node);
+		NODE_UPDATE_BALANCE(layout, node);
+
+		subtree = Node_rebalance(layout, node);
+		if ( subtree != node ) {
+			Node_relink(layout, root,
+				i > 0 ? path->nodes[i - 1] : NULL, node, subtree);
+		}
+
+		if ( NODE_HEIGHT(layout, subtree) == height ) break;
+	}
+
+	return;
+}
+
+/* Rebalances an AVL tree after the leaf at the end of 'path' was linked,
+ * starting from its parent.
+ */
+static void Node_avlInserted(BinaryTree * tree, NodeStack * path) {
+	path->len--;
+	Node_retrace(&tree->pool.layout, &tree->root, path);
+
+	return;
+}
+
+static void Node_avlRemoved(BinaryTree * tree, NodeStack * path) {
+	Node_retrace(&tree->pool.layout, &tree->root, path);
+
+	return;
+}
+
+/* Restores the rank rule of WAVL trees, that every node's rank exceeds its
+ * children's by 1 or 2, and that leaves have rank 1, after the leaf at the
+ * end of 'path' was linked. Nodes that end up with a child of the same
+ * rank are promoted, up to the first one whose other child allows it, where
+ * at most two rotations finish the job.
+ */
+static void Node_wavlInserted(BinaryTree * tree, NodeStack * path) {
+	NodeLayout * layout = &tree->pool.layout;
+	Node ** root = &tree->root;
+	Py_ssize_t i;
+	Node * node, * child, * inner, * subtree;
+	int rank, left;
+
+	for ( i = path->len - 2; i >= 0; i-- ) {
+		node = path->nodes[i];
+		rank = NODE_HEIGHT(layout, node);
+
+		if ( NODE_RANK(layout, node->lchild) == rank )
+			left = 1;
+		else if ( NODE_RANK(layout, node->rchild) == rank )
+			left = 0;
+		else
+			break;
+
+		if ( rank - NODE_RANK(layout,
+				left ? node->rchild : node->lchild) == 1 ) {
+			NODE_HEIGHT(layout, node)++;
+			continue;
+		}
+
+		/* Rotations recompute heights, so ranks are set afterwards */
+		child = left ? node->lchild : node->rchild;
+		inner = left ? child->rchild : child->lchild;
+
+		if ( rank - NODE_RANK(layout, inner) == 2 ) {
+			subtree = left ? rotateRight(layout, node) :
+					rotateLeft(layout, node);
+			NODE_HEIGHT(layout, child) = rank;
+		} else if ( left ) {
+			node->lchild = rotateLeft(layout, child);
+			subtree = rotateRight(layout, node);
+			NODE_HEIGHT(layout, inner) = rank;
+			NODE_HEIGHT(layout, child) = rank - 1;
+		} else {
+			node->rchild = rotateRight(layout, child);
+			subtree = rotateLeft(layout, node);
+			NODE_HEIGHT(layout, inner) = rank;
+			NODE_HEIGHT(layout, child) = rank - 1;
+		}
+
+		NODE_HEIGHT(layout, node) = rank - 1;
+		Node_relink(layout, root, i > 0 ? path->nodes[i - 1] : NULL,
+				node, subtree);
+		break;
+	}
+
+	return;
+}
+
+/* Restores the rank rule of WAVL trees after the subtree below the last
+ * node of 'path' lost a node, which leaves either a leaf of rank 2, or a
+ * node whose rank exceeds a child's by 3. Such nodes are demoted, along
+ * with their other child if it has room for it, up to the first node where
+ * at most two rotations finish the job.
+ */
+static void Node_wavlRemoved(BinaryTree * tree, NodeStack * path) {
+	NodeLayout * layout = &tree->pool.layout;
+	Node ** root = &tree->root;
+	Py_ssize_t i;
+	Node * node, * sibling, * inner, * outer, * subtree;
+	int rank, left;
+
+	for ( i = path->len - 1; i >= 0; i-- ) {
+		node = path->nodes[i];
+		rank = NODE_HEIGHT(layout, node);
+
+		if ( node->lchild == NULL && node->rchild == NULL ) {
+			if ( rank == 1 ) break;
+
+			NODE_HEIGHT(layout, node) = 1;
+			continue;
+		}
+
+		if ( rank - NODE_RANK(layout, node->lchild) == 3 )
+			left = 1;
+		else if ( rank - NODE_RANK(layout, node->rchild) == 3 )
+			left = 0;
+		else
+			break;
+
+		/* The sibling of the short side is at least of rank 1 */
+		sibling = left ? node->rchild : node->lchild;
+		inner = left ? sibling->lchild : sibling->rchild;
+		outer = left ? sibling->rchild : sibling->lchild;
+
+		if ( rank - NODE_HEIGHT(layout, sibling) == 2 ) {
+			NODE_HEIGHT(layout, node)--;
+			continue;
+		}
+
+		if ( NODE_HEIGHT(layout, sibling) -
+				NODE_RANK(layout, inner) == 2 &&
+			NODE_HEIGHT(layout, sibling) -
+				NODE_RANK(layout, outer) == 2 ) {
+			NODE_HEIGHT(layout, node)--;
+			NODE_HEIGHT(layout, sibling)--;
+			continue;
+		}
+
+		/* Rotations recompute heights, so ranks are set afterwards */
+		if ( NODE_HEIGHT(layout, sibling) -
+				NODE_RANK(layout, outer) == 1 ) {
+			subtree = left ? rotateLeft(layout, node) :
+					rotateRight(layout, node);
+			NODE_HEIGHT(layout, sibling) = rank;
+			NODE_HEIGHT(layout, node) = (node->lchild == NULL &&
+					node->rchild == NULL) ? 1 : rank - 1;
+		} else {
+			if ( left ) {
+				node->rchild = rotateRight(layout, sibling);
+				subtree = rotateLeft(layout, node);
+			} else {
+				node->lchild = rotateLeft(layout, sibling);
+				subtree = rotateRight(layout, node);
+			}
+
+			NODE_HEIGHT(layout, inner) = rank;
+			NODE_HEIGHT(layout, sibling) = rank - 2;
+			NODE_HEIGHT(layout, node) = rank - 2;
+		}
+
+		Node_relink(layout, root, i > 0 ? path->nodes[i - 1] : NULL,
+				node, subtree);
+		break;
+	}
+
+	return;
+}
+
+/* Moves the last node of 'path' up to the root of the tree, two levels at a
+ * time, by rotating either its parent and grandparent (zig-zig) or itself
+ * twice (zig-zag), with a single rotation (zig) left for the last level.
+ * If 'semi' is set, zig-zig steps skip the second rotation and carry on from
+ * the parent, which halves the depth of the path instead.
+ * Every rotation recomputes the heights and sizes of the two nodes rotated,
+ * which leaves them up to date along the whole path, as long as those below
+ * the last node are.
+ */
+static void Node_splayPath(NodeLayout * layout, Node ** root,
+				NodeStack * path, int semi) {
+	Node * node, * parent, * grandparent, * subtree;
+	Py_ssize_t i = path->len - 1;
+
+	if ( i < 0 ) return;
+
+	node = path->nodes[i];
+	Node_updateHeight(layout, node);
+
+	while ( i > 0 ) {
+		parent = path->nodes[i - 1];
+
+		if ( i == 1 ) {
+			subtree = (parent->lchild == node) ?
+					rotateRight(layout, parent) :
+					rotateLeft(layout, parent);
+			Node_relink(layout, root, NULL, parent, subtree);
+			break;
+		}
+
+		grandparent = path->nodes[i - 2];
+
+		if ( (grandparent->lchild == parent) ==
+			(parent->lchild == node) ) {
+			subtree = (grandparent->lchild == parent) ?
+					rotateRight(layout, grandparent) :
+					rotateLeft(layout, grandparent);
+
+			if ( semi ) {
+				node = parent;
+			} else {
+				subtree = (parent->lchild == node) ?
+						rotateRight(layout, parent) :
+						rotateLeft(layout, parent);
+			}
+		} else if ( grandparent->lchild == parent ) {
+			grandparent->lchild = rotateLeft(layout, parent);
+			subtree = rotateRight(layout, grandparent);
+		} else {
+			grandparent->rchild = rotateRight(layout, parent);
+			subtree = rotateLeft(layout, grandparent);
+		}
+
+		Node_relink(layout, root, i > 2 ? path->nodes[i - 3] : NULL,
+				grandparent, subtree);
+
+		i -= 2;
+		path->nodes[i] = node;
+	}
+
+	return;
+}
+
+static void Node_splay(BinaryTree * tree, NodeStack * path) {
+	Node_splayPath(&tree->pool.layout, &tree->root, path, 0);
+
+	return;
+}
+
+static void Node_semiSplay(BinaryTree * tree, NodeStack * path) {
+	Node_splayPath(&tree->pool.layout, &tree->root, path, 1);
+
+	return;
+}
+
+/* Updates the heights of the nodes of 'path' from index 'i' up, stopping
+ * at the first one whose height doesn't change.
+ */
+static void Node_retraceHeights(NodeLayout * layout, NodeStack * path,
+					Py_ssize_t i) {
+	Node * node;
+	int height;
+
+	for ( ; i >= 0; i-- ) {
+		node = path->nodes[i];
+		height = NODE_HEIGHT(layout, node);
+
+		Node_updateHeight(layout, node);
+		if ( NODE_HEIGHT(layout, node) == height ) break;
+	}
+
+	return;
+}
+
+/* Gives the leaf at the end of 'path' a random priority, and rotates it up
+ * above its ancestors of lower priority, which restores heap order.
+ */
+static void Node_treapInserted(BinaryTree * tree, NodeStack * path) {
+	NodeLayout * layout = &tree->pool.layout;
+	Node ** root = &tree->root;
+	Py_ssize_t i = path->len - 1;
+	Node * node = path->nodes[i], * parent, * subtree;
+	unsigned int priority;
+
+	priority = (unsigned int) (nextRandom(&random_state) >> 32);
+	NODE_PRIORITY(layout, node) = priority;
+
+	while ( i > 0 && NODE_PRIORITY(layout, path->nodes[i - 1]) < priority ) {
+		parent = path->nodes[i - 1];
+		subtree = (parent->lchild == node) ?
+				rotateRight(layout, parent) :
+				rotateLeft(layout, parent);
+		Node_relink(layout, root, i > 1 ? path->nodes[i - 2] : NULL,
+				parent, subtree);
+
+		path->nodes[--i] = node;
+	}
+
+	Node_retraceHeights(layout, path, i - 1);
+
+	return;
+}
+
+/* Removal keeps heap order, as the node taking the place of the removed
+ * one also takes its priority, so only heights need fixing.
+ */
+static void Node_treapRemoved(BinaryTree * tree, NodeStack * path) {
+	Node_retraceHeights(&tree->pool.layout, path, path->len - 1);
+
+	return;
+}
+
+/* Returns a random priority for a treap node of height 'height' in a
+ * perfectly balanced tree. Each height gets its own band of priorities,
+ * the bands halving in width towards the top as the levels of the tree
+ * do, so that priorities are spread as if drawn at random for each node,
+ * while heap order holds.
+ */
+static unsigned int treapPriority(int height) {
+	unsigned int band = (height < 32) ? 0xFFFFFFFFu >> height : 0;
+
+	return 0xFFFFFFFFu - band -
+		((unsigned int) nextRandom(&random_state) & band);
+}
+
+/* Splits the treap whose root is the first node of 'path' into the nodes
+ * before the last node of 'path', rooted at '*left', and the rest, rooted at
+ * '*right'. The nodes on 'path' are dealt to either side by whether the path
+ * goes right or left from them, so no comparisons are made, and their
+ * heights, sizes and parents are then fixed bottom-up. Nodes only gain
+ * children among their former descendants, so heap order holds.
+ */
+static void Node_splitBefore(NodeLayout * layout, NodeStack * path,
+				Node ** left, Node ** right) {
+	Node ** lhook = left, ** rhook = right, * node, * last;
+	Py_ssize_t i;
+
+	last = path->nodes[path->len - 1];
+
+	for ( i = 0; i < path->len - 1; i++ ) {
+		node = path->nodes[i];
+
+		if ( node->rchild == path->nodes[i + 1] ) {
+			*lhook = node;
+			lhook = &node->rchild;
+		} else {
+			*rhook = node;
+			rhook = &node->lchild;
+		}
+	}
+
+	*lhook = last->lchild;
+	last->lchild = NULL;
+	*rhook = last;
+
+	for ( i = path->len - 1; i >= 0; i-- ) {
+		node = path->nodes[i];
+
+		NODE_SET_PARENT(layout, node->lchild, node);
+		NODE_SET_PARENT(layout, node->rchild, node);
+		Node_updateHeight(layout, node);
+		NODE_UPDATE_COUNT(layout, node);
+	}
+
+	NODE_SET_PARENT(layout, *left, NULL);
+	NODE_SET_PARENT(layout, *right, NULL);
+
+	return;
+}
+
+/* Merges the treaps at 'left' and 'right', all of whose nodes come after
+ * those of 'left', by zipping the right spine of 'left' with the left spine
+ * of 'right' in heap order. 'spine' must have room for the heights of both
+ * treaps, and is used to fix heights, sizes and parents bottom-up.
+ * Returns the root of the merged treap.
+ */
+static Node * Node_merge(NodeLayout * layout, Node * left, Node * right,
+				NodeStack * spine) {
+	Node * root = NULL, ** hook = &root, * node;
+	Py_ssize_t i;
+
+	spine->len = 0;
+	while ( left != NULL && right != NULL ) {
+		if ( NODE_PRIORITY(layout, left) >= NODE_PRIORITY(layout, right) ) {
+			node = left;
+			left = left->rchild;
+			*hook = node;
+			hook = &node->rchild;
+		} else {
+			node = right;
+			right = right->lchild;
+			*hook = node;
+			hook = &node->lchild;
+		}
+
+		spine->nodes[spine->len++] = node;
+	}
+
+	*hook = (left != NULL) ? left : right;
+
+	for ( i = spine->len - 1; i >= 0; i-- ) {
+		node = spine->nodes[i];
+
+		NODE_SET_PARENT(layout, node->lchild, node);
+		NODE_SET_PARENT(layout, node->rchild, node);
+		Node_updateHeight(layout, node);
+		NODE_UPDATE_COUNT(layout, node);
+	}
+
+	NODE_SET_PARENT(layout, root, NULL);
+
+	return root;
+}
+
+/* Returns the deepest a leaf may be linked in a scapegoat tree of 'n'
+ * nodes, counting edges from the root, which is log(n) in base 3/2.
+ */
+static Py_ssize_t scapegoatDepth(Py_ssize_t n) {
+	if ( n <= 1 ) return 0;
+
+	return (Py_ssize_t) (log((double) n) / log(1.5));
+}
+
+/* Rebuilds part of a scapegoat tree if the leaf at the end of 'path' was
+ * linked too deep. Its parent's subtree is then lopsided somewhere up the
+ * path, at a node one of whose children holds more than 2/3 of its nodes:
+ * the scapegoat, whose subtree is rebuilt perfectly balanced. Subtree sizes
+ * are counted if the nodes don't keep them.
+ */
+static void Node_scapegoatInserted(BinaryTree * tree, NodeStack * path) {
+	NodeLayout * layout = &tree->pool.layout;
+	Node * node, * parent, * sibling, * head;
+	Py_ssize_t i, size = 1, total;
+
+	if ( tree->pool.size > tree->peak ) tree->peak = tree->pool.size;
+	if ( path->len - 1 <= scapegoatDepth(tree->pool.size) ) return;
+
+	node = path->nodes[path->len - 1];
+	for ( i = path->len - 2; i >= 0; i-- ) {
+		parent = path->nodes[i];
+		sibling = (parent->lchild == node) ? parent->rchild :
+							parent->lchild;
+		total = size + 1 + Node_size(layout, sibling);
+
+		if ( 3 * size > 2 * total ) break;
+
+		node = parent;
+		size = total;
+	}
+
+	/* Only reached by subtrees that were out of balance to begin with */
+	if ( i < 0 ) return;
+
+	head = Node_toVine(parent);
+	Node_relink(layout, &tree->root, i > 0 ? path->nodes[i - 1] : NULL,
+			parent, Node_buildFromVine(layout, &head, total));
+
+	return;
+}
+
+/* Rebuilds a scapegoat tree whole once removals have left it with less than
+ * 2/3 of the items it held at its peak.
+ */
+static void Node_scapegoatRemoved(BinaryTree * tree, NodeStack * path) {
+	NodeLayout * layout = &tree->pool.layout;
+	Node * head;
+
+	(void) path;
+
+	if ( 3 * tree->pool.size >= 2 * tree->peak ) return;
+
+	head = Node_toVine(tree->root);
+	tree->root = Node_buildFromVine(layout, &head, tree->pool.size);
+	NODE_SET_PARENT(layout, tree->root, NULL);
+	tree->peak = tree->pool.size;
+
+	return;
+}
+
+/* Returns the balancing scheme called 'name', or NULL (with ValueError set)
+ * if there is none.
+ */
+static const Balancer * findBalancer(const char * name) {
+	const Balancer * balancer;
+
+	for ( balancer = balancers; balancer->name != NULL; balancer++ ) {
+		if ( strcmp(balancer->name, name) == 0 ) return balancer;
+	}
+
+	PyErr_Format(PyExc_ValueError, "unknown balancing scheme '%s'", name);
+	return NULL;
+}
+
+/* Returns the key type called 'name', or NULL (with ValueError set) if
+ * there is none.
+ */
+static const KeyType * findKeyType(const char * name) {
+	const KeyType * keys;
+
+	for ( keys = key_types; keys->name != NULL; keys++ ) {
+		if ( strcmp(keys->name, name) == 0 ) return keys;
+	}
+
+	PyErr_Format(PyExc_ValueError, "unknown key type '%s'", name);
+	return NULL;
+}
+
+/* Encodes 'item' into 'key', if the tree encodes its items into keys.
+ * Encoding may run arbitrary code, so it is done before descending. Keys of
+ * another kind than those in the tree are rejected, as they don't compare.
+ * Returns 0 on success, -1 on failure.
+ */
+static int BinaryTree_encode(BinaryTree * self, PyObject * item, Key * key) {
+	PY_LONG_LONG value, held;
+
+	if ( self->keys == NULL ) return 0;
+
+	if ( self->keys->encode(item, key) < 0 ) return -1;
+
+	if ( self->keys->mixed != NULL && self->root != NULL ) {
+		memcpy(&value, key, sizeof(value));
+		memcpy(&held, NODE_KEY(&self->pool.layout, self->root),
+			sizeof(held));
+
+		if ( (value ^ held) & 1 ) {
+			PyErr_SetString(PyExc_TypeError, self->keys->mixed);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Releases a key encoded by BinaryTree_encode that no node took over */
+static void BinaryTree_releaseKey(BinaryTree * self, Key * key) {
+	if ( self->pool.layout.fields & NODE_OBJECT_KEYS )
+		Py_CLEAR(key->object);
+}
+
+/* Compares the item in 'node' with 'item', whose key is 'key', storing -1,
+ * 0 or 1 in 'result' as compareItems does. Trees that encode their items
+ * compare the keys, which can't fail.
+ * Returns 0 on success, -1 if the comparison raised.
+ */
+static int BinaryTree_compareNode(BinaryTree * self, Node * node,
+					PyObject * item, Key * key,
+					int * result) {
+	int cmp;
+
+	if ( self->keys == NULL )
+		return compareItems(node->item, item, result);
+
+	cmp = self->keys->compare(NODE_KEY(&self->pool.layout, node), key);
+	*result = (cmp > 0) - (cmp < 0);
+	return 0;
+}
+
+/* Appends the 'n' bytes at 'data' to 'buffer'.
+ * Returns 0 on success, -1 (with MemoryError set) on failure.
+ */
+static int ByteBuffer_append(ByteBuffer * buffer, const void * data,
+				Py_ssize_t n) {
+	unsigned char * grown;
+	Py_ssize_t allocated = buffer->allocated;
+
+	if ( buffer->len + n > allocated ) {
+		while ( buffer->len + n > allocated ) allocated *= 2;
+
+		if ( buffer->data == buffer->prealloc ) {
+			grown = PyMem_Malloc(allocated);
+			if ( grown != NULL )
+				memcpy(grown, buffer->data, buffer->len);
+		} else {
+			grown = PyMem_Realloc(buffer->data, allocated);
+		}
+
+		if ( grown == NULL ) {
+			PyErr_NoMemory();
+			return -1;
+		}
+
+		buffer->data = grown;
+		buffer->allocated = allocated;
+	}
+
+	memcpy(buffer->data + buffer->len, data, n);
+	buffer->len += n;
+	return 0;
+}
+
+/* Field tags of memcmp keys, in the order Python 2 gives to their types.
+ * The end of a tuple sorts first, so that tuples sort before those they
+ * are a prefix of. */
+#define KEY_TAG_END 0x00
+#define KEY_TAG_NONE 0x01
+#define KEY_TAG_NUMBER 0x02
+#define KEY_TAG_STRING 0x03
+#define KEY_TAG_TUPLE 0x04
+
+/* Appends the memcmp encoding of 'item' to 'buffer', as a tag followed by
+ * the field itself:
+ *  - numbers as their nearest double, with the bits of negative doubles
+ *    flipped and the sign bit of the others set, then the difference from
+ *    the double of integers past its precision, with the sign bit flipped,
+ *    both big-endian.
+ *  - strings as their bytes, with NULs escaped as 0x00 0xFF, ended by
+ *    0x00 0x01.
+ *  - tuples as their fields, ended by KEY_TAG_END.
+ * Returns 0 on success, -1 (with TypeError set if 'item' is of a type
+ * that can't be encoded) on failure.
+ */
+static int encodeField(ByteBuffer * buffer, PyObject * item) {
+	static const unsigned char escape[2] = {0x00, 0xFF};
+	static const unsigned char terminator[2] = {0x00, 0x01};
+	unsigned char tag, bytes[16];
+	unsigned PY_LONG_LONG bits, residual;
+	PY_LONG_LONG v = 0;
+	const char * s, * nul;
+	double d;
+	Py_ssize_t n, i;
+	int status;
+
+	if ( item == Py_None ) {
+		tag = KEY_TAG_NONE;
+		return ByteBuffer_append(buffer, &tag, 1);
+	}
+
+	if ( PyString_CheckExact(item) ) {
+		tag = KEY_TAG_STRING;
+		if ( ByteBuffer_append(buffer, &tag, 1) < 0 ) return -1;
+
+		s = PyString_AS_STRING(item);
+		n = PyString_GET_SIZE(item);
+		while ( (nul = memchr(s, 0, n)) != NULL ) {
+			if ( ByteBuffer_append(buffer, s, nul - s) < 0 ||
+				ByteBuffer_append(buffer, escape, 2) < 0 )
+				return -1;
+
+			n -= nul - s + 1;
+			s = nul + 1;
+		}
+
+		if ( ByteBuffer_append(buffer, s, n) < 0 ) return -1;
+		return ByteBuffer_append(buffer, terminator, 2);
+	}
+
+	if ( PyTuple_CheckExact(item) ) {
+		tag = KEY_TAG_TUPLE;
+		if ( ByteBuffer_append(buffer, &tag, 1) < 0 ) return -1;
+
+		if ( Py_EnterRecursiveCall(" while encoding a key") )
+			return -1;
+
+		status = 0;
+		for ( i = 0; i < PyTuple_GET_SIZE(item) && status == 0; i++ )
+			status = encodeField(buffer, PyTuple_GET_ITEM(item, i));
+
+		Py_LeaveRecursiveCall();
+		if ( status < 0 ) return -1;
+
+		tag = KEY_TAG_END;
+		return ByteBuffer_append(buffer, &tag, 1);
+	}
+
+	if ( PyFloat_CheckExact(item) ) {
+		d = PyFloat_AS_DOUBLE(item);
+		if ( Py_IS_NAN(d) ) {
+			PyErr_SetString(PyExc_ValueError,
+				"cannot encode NaN into a key");
+			return -1;
+		}
+	} else if ( PyInt_CheckExact(item) || PyBool_Check(item) ) {
+		v = PyInt_AS_LONG(item);
+		d = (double) v;
+	} else if ( PyLong_CheckExact(item) ) {
+		v = PyLong_AsLongLong(item);
+		if ( v == -1 && PyErr_Occurred() != NULL ) return -1;
+		d = (double) v;
+	} else {
+		PyErr_Format(PyExc_TypeError,
+			"cannot encode '%.200s' into a key",
+			Py_TYPE(item)->tp_name);
+		return -1;
+	}
+
+	/* -0.0 is 0.0, floats are their own double, and the double of an
+	 * integer may be 2 ** 63, which doesn't fit back into one */
+	if ( d == 0.0 ) d = 0.0;
+	memcpy(&bits, &d, sizeof(bits));
+	bits = (bits >> 63) ? ~bits : (bits | (1ULL << 63));
+
+	if ( PyFloat_CheckExact(item) )
+		residual = 0;
+	else if ( d >= 9223372036854775808.0 )
+		residual = (unsigned PY_LONG_LONG) v - (1ULL << 63);
+	else
+		residual = (unsigned PY_LONG_LONG) (v - (PY_LONG_LONG) d);
+	residual ^= 1ULL << 63;
+
+	for ( i = 0; i < 8; i++ ) {
+		bytes[i] = (unsigned char) (bits >> (56 - 8 * i));
+		bytes[8 + i] = (unsigned char) (residual >> (56 - 8 * i));
+	}
+
+	tag = KEY_TAG_NUMBER;
+	if ( ByteBuffer_append(buffer, &tag, 1) < 0 ) return -1;
+	return ByteBuffer_append(buffer, bytes, 16);
+}
+
+/* Encodes 'item' into a string whose bytes compare as the item does, for
+ * None, numbers that fit in 64 bits, strings and tuples of them.
+ * Returns 0 on success, -1 on failure.
+ */
+static int encodeMemcmp(PyObject * item, void * key) {
+	ByteBuffer buffer;
+	PyObject * encoded = NULL;
+
+	buffer.data = buffer.prealloc;
+	buffer.len = 0;
+	buffer.allocated = BYTEBUFFER_PREALLOC;
+
+	if ( encodeField(&buffer, item) == 0 )
+		encoded = PyString_FromStringAndSize((char *) buffer.data,
+							buffer.len);
+
+	if ( buffer.data != buffer.prealloc ) PyMem_Free(buffer.data);
+
+	*(PyObject **) key = encoded;
+	return (encoded != NULL) ? 0 : -1;
+}
+
+static int compareMemcmp(const void * a, const void * b) {
+	PyObject * x = *(PyObject * const *) a, * y = *(PyObject * const *) b;
+	Py_ssize_t nx = PyString_GET_SIZE(x), ny = PyString_GET_SIZE(y);
+	int cmp;
+
+	cmp = memcmp(PyString_AS_STRING(x), PyString_AS_STRING(y),
+			(nx < ny) ? nx : ny);
+	if ( cmp != 0 ) return cmp;
+
+	return (nx > ny) - (nx < ny);
+}
+
+/* Reads the 8 bytes at 'bytes' as a big-endian word, so that words compare
+ * as their bytes do. Compilers turn this into a load and a byte swap. */
+static unsigned PY_LONG_LONG loadWord(const unsigned char * bytes) {
+	unsigned PY_LONG_LONG word = 0;
+	int i;
+
+	for ( i = 0; i < 8; i++ ) word = (word << 8) | bytes[i];
+
+	return word;
+}
+
+/* Copies 'item', which must be a string of 'size' bytes, into 'key'.
+ * Returns 0 on success, -1 (with TypeError or ValueError set) on failure.
+ */
+static int encodeBytes(PyObject * item, void * key, Py_ssize_t size) {
+	if (! PyString_CheckExact(item) ) {
+		PyErr_Format(PyExc_TypeError,
+			"cannot encode '%.200s' into a key",
+			Py_TYPE(item)->tp_name);
+		return -1;
+	}
+
+	if ( PyString_GET_SIZE(item) != size ) {
+		PyErr_Format(PyExc_ValueError,
+			"keys must be strings of %zd bytes", size);
+		return -1;
+	}
+
+	memcpy(key, PyString_AS_STRING(item), size);
+	return 0;
+}
+
+/* Compares the keys at 'a' and 'b', of 'words' 64 bit words each */
+static int compareWords(const void * a, const void * b, int words) {
+	unsigned PY_LONG_LONG x, y;
+	int i;
+
+	for ( i = 0; i < words; i++ ) {
+		x = loadWord((const unsigned char *) a + 8 * i);
+		y = loadWord((const unsigned char *) b + 8 * i);
+		if ( x != y ) return (x > y) ? 1 : -1;
+	}
+
+	return 0;
+}
+
+static int encodeBytes16(PyObject * item, void * key) {
+	return encodeBytes(item, key, 16);
+}
+
+static int compareBytes16(const void * a, const void * b) {
+	return compareWords(a, b, 2);
+}
+
+static int encodeBytes32(PyObject * item, void * key) {
+	return encodeBytes(item, key, 32);
+}
+
+static int compareBytes32(const void * a, const void * b) {
+	return compareWords(a, b, 4);
+}
+
+/* Stores the microseconds between 1970-01-01 and 'item', a datetime, in
+ * 'key', shifted left by one bit, which is set for datetimes with a UTC
+ * offset. Naive datetimes are taken to be in UTC, and those with a UTC
+ * offset are moved to UTC, which calls into their tzinfo.
+ * Returns 0 on success, -1 on failure.
+ */
+static int encodeDatetime(PyObject * item, void * key) {
+	static const int days_before_month[12] = {
+		0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334
+	};
+	PyDateTime_Delta * delta;
+	PyObject * offset;
+	PY_LONG_LONG days, us;
+	int year, month, aware = 0;
+
+	if (! PyDateTime_CheckExact(item) ) {
+		PyErr_Format(PyExc_TypeError,
+			"cannot encode '%.200s' into a key",
+			Py_TYPE(item)->tp_name);
+		return -1;
+	}
+
+	year = PyDateTime_GET_YEAR(item);
+	month = PyDateTime_GET_MONTH(item);
+
+	/* Days since 0001-01-01, then since the epoch, its 719162nd day */
+	days = 365 * (PY_LONG_LONG) (year - 1) + (year - 1) / 4 -
+		(year - 1) / 100 + (year - 1) / 400;
+	days += days_before_month[month - 1] + PyDateTime_GET_DAY(item) - 1;
+	if ( month > 2 && year % 4 == 0 && (year % 100 != 0 || year % 400 == 0) )
+		days++;
+	days -= 719162;
+
+	us = ((days * 24 + PyDateTime_DATE_GET_HOUR(item)) * 60 +
+		PyDateTime_DATE_GET_MINUTE(item)) * 60 +
+		PyDateTime_DATE_GET_SECOND(item);
+	us = us * 1000000 + PyDateTime_DATE_GET_MICROSECOND(item);
+
+	if ( ((PyDateTime_DateTime *) item)->hastzinfo ) {
+		/* datetime checks that it gets a timedelta or None */
+		offset = PyObject_CallMethod(item, "utcoffset", NULL);
+		if ( offset == NULL ) return -1;
+
+		if ( offset != Py_None ) {
+			delta = (PyDateTime_Delta *) offset;
+			us -= ((PY_LONG_LONG) delta->days * 86400 +
+				delta->seconds) * 1000000 + delta->microseconds;
+			aware = 1;
+		}
+
+		Py_DECREF(offset);
+	}
+
+	us = us * 2 + aware;
+	memcpy(key, &us, sizeof(us));
+	return 0;
+}
+
+/* Stores 'item', an integer that fits in 64 bits, in 'key'.
+ * Returns 0 on success, -1 on failure.
+ */
+static int encodeInt64(PyObject * item, void * key) {
+	PY_LONG_LONG value;
+
+	if ( PyInt_CheckExact(item) || PyBool_Check(item) ) {
+		value = PyInt_AS_LONG(item);
+	} else if ( PyLong_CheckExact(item) ) {
+		value = PyLong_AsLongLong(item);
+		if ( value == -1 && PyErr_Occurred() != NULL ) return -1;
+	} else {
+		PyErr_Format(PyExc_TypeError,
+			"cannot encode '%.200s' into a key",
+			Py_TYPE(item)->tp_name);
+		return -1;
+	}
+
+	memcpy(key, &value, sizeof(value));
+	return 0;
+}
+
+static int compareInt64(const void * a, const void * b) {
+	PY_LONG_LONG x = *(const PY_LONG_LONG *) a;
+	PY_LONG_LONG y = *(const PY_LONG_LONG *) b;
+
+	return (x > y) - (x < y);
+}
+
+/* Inserts 'item' into the tree, or into the tombstone left by an equal one.
+ * All comparisons are made while descending, before the tree is changed,
+ * so a failed comparison leaves the tree intact.
+ * Returns 1 if 'item' was inserted, 0 if it was already in the tree, -1 on
+ * failure.
+ */
+static int BinaryTree_insertItem(BinaryTree * self, PyObject * item) {
+	NodeLayout * layout = &self->pool.layout;
+	NodeStack path;
+	Node * current = self->root, * new;
+	PyObject * old;
+	Py_ssize_t i, version;
+	Key key;
+	int cmp = 0;
+
+	if ( BinaryTree_encode(self, item, &key) < 0 ) return -1;
+
+	NodeStack_init(&path);
+	version = self->version;
+
+	while ( current != NULL ) {
+		if ( BinaryTree_compareNode(self, current, item, &key,
+						&cmp) < 0 ||
+			checkVersion(self, version) < 0 ||
+			NodeStack_push(&path, current) < 0 ) {
+			NodeStack_free(&path);
+			BinaryTree_releaseKey(self, &key);
+			return -1;
+		}
+
+		if ( cmp == 0 ) break;
+
+		current = (cmp > 0) ? current->lchild : current->rchild;
+	}
+
+	if ( current != NULL ) {
+		BinaryTree_releaseKey(self, &key);
+		if (! NODE_IS_DEAD(layout, current) ) {
+			/* Item already in the tree */
+			NodeStack_free(&path);
+			return 0;
+		}
+
+		/* A tombstone takes the item back in its place, and counts
+		 * again */
+		old = current->item;
+		Py_INCREF(item);
+		current->item = item;
+		NODE_DEAD(layout, current) = 0;
+		if ( layout->count != 0 ) {
+			for ( i = 0; i < path.len; i++ )
+				NODE_COUNT(layout, path.nodes[i])++;
+		}
+		self->dead--;
+		self->version++;
+
+		NodeStack_free(&path);
+		Py_DECREF(old);
+		return 1;
+	}
+
+	/* Make room for the new leaf on the path, then create it */
+	if ( NodeStack_reserve(&path, 1) < 0 ) {
+		NodeStack_free(&path);
+		BinaryTree_releaseKey(self, &key);
+		PyErr_NoMemory();
+		return -1;
+	}
+
+	new = Node_new(&self->pool);
+	if ( new == NULL ) {
+		NodeStack_free(&path);
+		BinaryTree_releaseKey(self, &key);
+		return -1;
+	}
+
+	Py_INCREF(item);
+	new->item = item;
+
+	/* The node takes over the key */
+	if ( layout->key != 0 )
+		memcpy(NODE_KEY(layout, new), &key, layout->keysize);
+
+	/* No more comparisons from here on */
+	if ( path.len == 0 )
+		self->root = new;
+	else if ( cmp > 0 )
+		path.nodes[path.len - 1]->lchild = new;
+	else
+		path.nodes[path.len - 1]->rchild = new;
+
+	NODE_SET_PARENT(layout, new,
+			path.len > 0 ? path.nodes[path.len - 1] : NULL);
+
+	/* Every node on the path gained a descendant */
+	if ( layout->count != 0 ) {
+		for ( i = 0; i < path.len; i++ )
+			NODE_COUNT(layout, path.nodes[i])++;
+	}
+
+	/* Room for it was made before the tree was changed */
+	path.nodes[path.len++] = new;
+	self->balancer->inserted(self, &path);
+	self->version++;
+
+	NodeStack_free(&path);
+	return 1;
+}
+
+/* Removes the node that contains 'target' from the tree.
+ * As with BinaryTree_insertItem, the node is located before the tree is
+ * changed, and the rest of the removal makes no comparisons.
+ * In trees that keep tombstones, the node is only marked as one, and the
+ * tree is purged of them once they pass its 'tombstones' fraction.
+ * Returns 1 if 'target' was removed, 0 if it wasn't in the tree, -1 on
+ * failure.
+ */
+static int BinaryTree_removeItem(BinaryTree * self, PyObject * target) {
+	NodeStack path;
+	Node * rm = self->root;
+	PyObject * item;
+	Py_ssize_t version;
+	Key key;
+	int cmp = 1;
+
+	if ( BinaryTree_encode(self, target, &key) < 0 ) return -1;
+
+	NodeStack_init(&path);
+	version = self->version;
+
+	while ( rm != NULL ) {
+		if ( BinaryTree_compareNode(self, rm, target, &key, &cmp) < 0 ||
+			checkVersion(self, version) < 0 ) {
+			NodeStack_free(&path);
+			BinaryTree_releaseKey(self, &key);
+			return -1;
+		}
+
+		if ( cmp == 0 ) break;
+
+		if ( NodeStack_push(&path, rm) < 0 ) {
+			NodeStack_free(&path);
+			BinaryTree_releaseKey(self, &key);
+			return -1;
+		}
+
+		rm = (cmp > 0) ? rm->lchild : rm->rchild;
+	}
+
+	BinaryTree_releaseKey(self, &key);
+
+	if ( rm == NULL || NODE_IS_DEAD(&self->pool.layout, rm) ) {
+		/* Not in the tree */
+		NodeStack_free(&path);
+		return 0;
+	}
+
+	if ( self->pool.layout.dead != 0 ) {
+		item = BinaryTree_bury(self, &path, rm);
+		NodeStack_free(&path);
+		BinaryTree_prune(self);
+		Py_XDECREF(item);
+
+		return 1;
+	}
+
+	item = BinaryTree_unlinkNode(self, &path, rm);
+	NodeStack_free(&path);
+	if ( item == NULL ) return -1;
+
+	/* The tree is consistent again, so it's safe to release the item,
+	 * which may run arbitrary code. */
+	Py_DECREF(item);
+
+	return 1;
+}
+
+/* Makes 'node' a tombstone, given the 'path' of its ancestors from the
+ * root, which no longer counts it. Handles, which could still reach it, are
+ * invalidated. In trees with keys, which route lookups on their own, the
+ * item is taken out of the node, leaving None in its place.
+ * Returns the item taken out, whose reference passes to the caller, or
+ * NULL if the node keeps it.
+ */
+static PyObject * BinaryTree_bury(BinaryTree * self, NodeStack * path,
+					Node * node) {
+	NodeLayout * layout = &self->pool.layout;
+	PyObject * item = NULL;
+	Py_ssize_t i;
+
+	NODE_DEAD(layout, node) = 1;
+	if ( layout->count != 0 ) {
+		for ( i = 0; i < path->len; i++ )
+			NODE_COUNT(layout, path->nodes[i])--;
+		NODE_COUNT(layout, node)--;
+	}
+
+	if ( self->keys != NULL ) {
+		item = node->item;
+		Py_INCREF(Py_None);
+		node->item = Py_None;
+	}
+
+	self->dead++;
+	self->epoch++;
+	self->version++;
+
+	return item;
+}
+
+/* Purges the tree once its tombstones pass its 'tombstones' fraction.
+ * Purging is left for later if memory is short, as the removals that
+ * left the tombstones are done.
+ */
+static void BinaryTree_prune(BinaryTree * self) {
+	if ( self->dead > self->tombstones * self->pool.size &&
+		BinaryTree_purge(self) < 0 )
+		PyErr_Clear();
+
+	return;
+}
+
+/* Takes 'rm' out of the tree, given the 'path' of its ancestors from the
+ * root, and returns it to the pool. No comparisons are made. 'path' is
+ * used as scratch space.
+ * Returns the item of 'rm', whose reference passes to the caller, or NULL
+ * (with MemoryError set) on failure, in which case the tree is unchanged.
+ */
+static PyObject * BinaryTree_unlinkNode(BinaryTree * self, NodeStack * path,
+					Node * rm) {
+	NodeLayout * layout = &self->pool.layout;
+	Node * parent, * pred;
+	PyObject * item;
+	Py_ssize_t i, index = -1;
+
+	parent = (path->len > 0) ? path->nodes[path->len - 1] : NULL;
+
+	if ( rm->lchild == NULL || rm->rchild == NULL ) {
+		/* A leaf or a Node with only one child, which takes its place */
+		Node_relink(layout, &self->root, parent, rm,
+			rm->lchild != NULL ? rm->lchild : rm->rchild);
+	} else {
+		/* rm has both lchild and rchild, so its in-order predecessor
+		 * takes its place. The predecessor is linked into the tree
+		 * instead of having items swapped, so that Nodes keep their
+		 * items. */
+		index = path->len;
+		if ( NodeStack_push(path, rm) < 0 ) return NULL;
+
+		pred = rm->lchild;
+		while ( pred->rchild != NULL ) {
+			if ( NodeStack_push(path, pred) < 0 ) return NULL;
+
+			pred = pred->rchild;
+		}
+
+		if ( pred != rm->lchild ) {
+			path->nodes[path->len - 1]->rchild = pred->lchild;
+			NODE_SET_PARENT(layout, pred->lchild,
+					path->nodes[path->len - 1]);
+			pred->lchild = rm->lchild;
+			NODE_SET_PARENT(layout, pred->lchild, pred);
+		}
+
+		pred->rchild = rm->rchild;
+		NODE_SET_PARENT(layout, pred->rchild, pred);
+		if ( layout->height != 0 ) {
+			NODE_HEIGHT(layout, pred) = NODE_HEIGHT(layout, rm);
+			NODE_BALANCE(layout, pred) = NODE_BALANCE(layout, rm);
+		}
+		if ( layout->priority != 0 )
+			NODE_PRIORITY(layout, pred) = NODE_PRIORITY(layout, rm);
+
+		Node_relink(layout, &self->root, parent, rm, pred);
+		path->nodes[index] = pred;
+	}
+
+	/* Every node on the path lost a descendant, and the predecessor took
+	 * over the subtree of 'rm' */
+	if ( layout->count != 0 ) {
+		for ( i = 0; i < path->len; i++ )
+			NODE_COUNT(layout, path->nodes[i])--;
+
+		if ( index >= 0 )
+			NODE_COUNT(layout, path->nodes[index]) =
+				NODE_COUNT(layout, rm) - 1;
+	}
+
+	/* The pool only counts the nodes left, as the balancer expects */
+	item = rm->item;
+	NodePool_free(&self->pool, rm);
+	self->balancer->removed(self, path);
+	self->epoch++;
+	self->version++;
+
+	return item;
+}
+
+/* Empties the tree in constant time. The detached arenas are queued for
+ * release if deferred freeing is enabled, or else released right away, by
+ * scanning them rather than walking the tree, once the tree is consistent.
+ */
+static void BinaryTree_discardNodes(BinaryTree * self) {
+	ReleaseQueue queue = { NULL, NULL, 0, 0 };
+	NodeArena * arenas;
+
+	arenas = NodePool_detach(&self->pool);
+	self->root = NULL;
+	self->peak = 0;
+	self->dead = 0;
+	self->epoch++;
+	self->version++;
+
+	if ( arenas == NULL ) return;
+
+	if ( release_chunk > 0 ) {
+		ReleaseQueue_push(&pending_release, arenas);
+		return;
+	}
+
+	ReleaseQueue_push(&queue, arenas);
+	ReleaseQueue_release(&queue, -1);
+
+	return;
+}
+
+/* Rids the tree of its tombstones, by flattening it into a vine, taking
+ * them out of it, and rebuilding the tree perfectly balanced from the rest,
+ * in O(n). Nodes are released, so the epoch is bumped.
+ * Reads skip tombstones, and subtree sizes leave them out, so this only
+ * happens once they pass the tree's 'tombstones' fraction, or when the
+ * tree is rebuilt or shrunk.
+ * Returns 0 on success, -1 (with MemoryError set) on failure, in which
+ * case the tree is unchanged.
+ */
+static int BinaryTree_purge(BinaryTree * self) {
+	NodeLayout * layout = &self->pool.layout;
+	PyObject ** released;
+	Node * node, * next, * head = NULL, ** tail = &head;
+	Py_ssize_t i, k = 0;
+
+	if ( self->dead == 0 ) return 0;
+
+	released = PyMem_New(PyObject *, self->dead);
+	if ( released == NULL ) {
+		PyErr_NoMemory();
+		return -1;
+	}
+
+	/* No more failures from here on */
+	for ( node = Node_toVine(self->root); node != NULL; node = next ) {
+		next = node->rchild;
+
+		if ( NODE_DEAD(layout, node) ) {
+			released[k++] = node->item;
+			NodePool_free(&self->pool, node);
+		} else {
+			*tail = node;
+			tail = &node->rchild;
+		}
+	}
+
+	self->root = Node_buildFromVine(layout, &head, self->pool.size);
+	NODE_SET_PARENT(layout, self->root, NULL);
+	self->peak = self->pool.size;
+	self->dead = 0;
+	self->epoch++;
+	self->version++;
+
+	/* Only release removed items once the tree is consistent again, as
+	 * that may run arbitrary code. */
+	for ( i = 0; i < k; i++ )
+		Py_DECREF(released[i]);
+
+	PyMem_Free(released);
+	return 0;
+}
+
+/* Returns the most nodes on any path down from the root: the height of the
+ * root where nodes keep heights, or else the bound scapegoat trees keep
+ * their depth within, with room for the leaf that sets off a rebuild.
+ */
+static Py_ssize_t BinaryTree_height(BinaryTree * self) {
+	NodeLayout * layout = &self->pool.layout;
+
+	if ( self->root == NULL ) return 0;
+
+	if ( layout->height != 0 ) return NODE_HEIGHT(layout, self->root);
+
+	return scapegoatDepth(self->peak) + 2;
+}
+
+/* Inserts 'new' into a binary tree.
+ * Returns None on success, NULL on error. */
+static PyObject * BinaryTree_insert(BinaryTree * self, PyObject * new) {
+	releasePending();
+
+	if ( BinaryTree_insertItem(self, new) == -1 )
+		return NULL;
+
+	Py_RETURN_NONE;
+}
+
+/* Removes 'target' from a binary tree, if it is there.
+ * Returns None on success, NULL on error. */
+static PyObject * BinaryTree_remove(BinaryTree * self, PyObject * target) {
+	releasePending();
+
+	if ( BinaryTree_removeItem(self, target) == -1 )
+		return NULL;
+
+	Py_RETURN_NONE;
+}
+
+/* Removes every item from the tree.
+ * Returns None.
+ */
+static PyObject * BinaryTree_clearNodes(BinaryTree * self) {
+	releasePending();
+	BinaryTree_discardNodes(self);
+
+	Py_RETURN_NONE;
+}
+
+/* Makes room for 'arg' more items, so that inserting them won't allocate.
+ * Returns None on success, NULL on failure.
+ */
+static PyObject * BinaryTree_reserve(BinaryTree * self, PyObject * arg) {
+	Py_ssize_t n;
+
+	n = PyNumber_AsSsize_t(arg, PyExc_OverflowError);
+	if ( n == -1 && PyErr_Occurred() != NULL ) return NULL;
+
+	if ( n < 0 ) {
+		PyErr_SetString(PyExc_ValueError,
+			"number of items must not be negative");
+		return NULL;
+	}
+
+	releasePending();
+
+	if ( NodePool_reserve(&self->pool, n) < 0 ) return NULL;
+
+	Py_RETURN_NONE;
+}
+
+/* Moves the nodes of the tree into a single arena of the exact size, laid
+ * out in-order, and frees all other arenas. This returns the memory left
+ * over by removals, which the free list would otherwise hold on to.
+ * Nodes move, so the epoch is bumped.
+ * Returns None on success, NULL on failure.
+ */
+static PyObject * BinaryTree_shrink(BinaryTree * self) {
+	NodeLayout * layout = &self->pool.layout;
+	NodeStack nodes;
+	NodeArena * arena = NULL, * old, * next;
+	Node * node;
+	Py_ssize_t i;
+
+	releasePending();
+
+	if ( BinaryTree_purge(self) < 0 ) return NULL;
+
+	if ( self->pool.capacity == self->pool.size ) Py_RETURN_NONE;
+
+	NodeStack_init(&nodes);
+	if ( Node_flatten(self->root, &nodes) < 0 ) {
+		NodeStack_free(&nodes);
+		return NULL;
+	}
+
+	if ( nodes.len > 0 ) {
+		arena = NodeArena_new(nodes.len, layout);
+		if ( arena == NULL ) {
+			NodeStack_free(&nodes);
+			return PyErr_NoMemory();
+		}
+
+		arena->used = nodes.len;
+	}
+
+	/* Copy every node, leaving the address of the copy in the 'rchild'
+	 * of the original, then point the copies at each other. */
+	for ( i = 0; i < nodes.len; i++ ) {
+		memcpy(NODEARENA_NODE(arena, i), nodes.nodes[i], layout->size);
+		nodes.nodes[i]->rchild = NODEARENA_NODE(arena, i);
+	}
+
+	for ( i = 0; i < nodes.len; i++ ) {
+		node = NODEARENA_NODE(arena, i);
+		if ( node->lchild != NULL ) node->lchild = node->lchild->rchild;
+		if ( node->rchild != NULL ) node->rchild = node->rchild->rchild;
+		if ( layout->parent != 0 && NODE_PARENT(layout, node) != NULL )
+			NODE_PARENT(layout, node) =
+				NODE_PARENT(layout, node)->rchild;
+	}
+
+	if ( self->root != NULL ) self->root = self->root->rchild;
+
+	for ( old = self->pool.arenas; old != NULL; old = next ) {
+		next = old->next;
+		NodeArena_free(old);
+	}
+
+	self->pool.arenas = arena;
+	self->pool.free = NULL;
+	self->pool.capacity = (arena != NULL) ? arena->capacity : 0;
+	self->epoch++;
+	self->version++;
+
+	NodeStack_free(&nodes);
+	Py_RETURN_NONE;
+}
+
+/* Relinks the nodes into a perfectly balanced tree, of the least height
+ * for its size, in O(n) and without comparisons or allocation: the tree is
+ * flattened into a vine and built back from it, or purged if it has
+ * tombstones. With 'compact', the tree is then shrunk.
+ * Returns None on success, NULL on failure.
+ */
+static PyObject * BinaryTree_rebuild(BinaryTree * self, PyObject * args,
+					PyObject * kwds) {
+	static char * kwlist[] = {"compact", NULL};
+	NodeLayout * layout = &self->pool.layout;
+	PyObject * compact = NULL;
+	Node * head;
+	int flag = 0;
+
+	if (! PyArg_ParseTupleAndKeywords(args, kwds, "|O:rebuild", kwlist,
+						&compact) )
+		return NULL;
+
+	if ( compact != NULL && (flag = PyObject_IsTrue(compact)) < 0 )
+		return NULL;
+
+	releasePending();
+
+	if ( self->dead != 0 ) {
+		if ( BinaryTree_purge(self) < 0 ) return NULL;
+	} else if ( self->root != NULL ) {
+		head = Node_toVine(self->root);
+		self->root = Node_buildFromVine(layout, &head,
+						self->pool.size);
+		NODE_SET_PARENT(layout, self->root, NULL);
+		self->peak = self->pool.size;
+		self->version++;
+	}
+
+	if ( flag ) return BinaryTree_shrink(self);
+
+	Py_RETURN_NONE;
+}
+
+/* Returns the number of items the tree can hold without allocating */
+static PyObject * BinaryTree_capacity(BinaryTree * self) {
+	return PyInt_FromSsize_t(self->pool.capacity);
+}
+
+static PyObject * BinaryTree_balance(BinaryTree * self) {
+	return PyString_FromString(self->balancer->name);
+}
+
+static PyObject * BinaryTree_keyType(BinaryTree * self) {
+	if ( self->keys == NULL ) Py_RETURN_NONE;
+
+	return PyString_FromString(self->keys->name);
+}
+
+/* Returns a Node handle to the root of the tree, or None if it's empty.
+ * A tombstone at the root is returned as is, holding None.
+ */
+static PyObject * BinaryTree_root(BinaryTree * self) {
+	return Node_wrap(self, self->root);
+}
+
+/* Finds 'target' in the subtree of 'tree' starting at 'root', storing the
+ * node that contains it in 'found', or NULL if it isn't there.
+ * Returns 0 on success, -1 on failure.
+ */
+static int Node_find(BinaryTree * tree, Node * root, PyObject * target,
+			Node ** found) {
+	Node * current = root;
+	Py_ssize_t version;
+	Key key;
+	int cmp;
+
+	if ( BinaryTree_encode(tree, target, &key) < 0 ) return -1;
+
+	version = tree->version;
+	while ( current ) {
+		if ( BinaryTree_compareNode(tree, current, target, &key,
+						&cmp) < 0 ||
+			checkVersion(tree, version) < 0 ) {
+			BinaryTree_releaseKey(tree, &key);
+			return -1;
+		}
+
+		switch ( cmp ) {
+			case 0:
+				*found = NODE_IS_DEAD(&tree->pool.layout,
+						current) ? NULL : current;
+				BinaryTree_releaseKey(tree, &key);
+				return 0;
+			case 1:
+				/* Descend left */
+				current = current->lchild;
+				break;
+			case -1:
+				/* Descend right */
+				current = current->rchild;
+				break;
+		}
+	}
+
+	BinaryTree_releaseKey(tree, &key);
+	*found = NULL;
+	return 0;
+}
+
+/* Finds 'target' in the subtree of 'tree' starting at 'root'.
+ * Returns the node containing 'target' as a new reference if it is in
+ * the tree, None if it is not, or NULL upon failure.
+ */
+static PyObject * Node_locate(BinaryTree * tree, Node * root,
+				PyObject * target) {
+	Node * found;
+
+	if ( Node_find(tree, root, target, &found) < 0 ) return NULL;
+
+	return Node_wrap(tree, found);
+}
+
+/* Finds 'target' in the tree, as Node_find does. In splay trees, the path
+ * down to where the search ended is kept, and the balancer then moves that
+ * node up, which counts as a change to the tree.
+ * Returns 0 on success, -1 on failure.
+ */
+static int BinaryTree_find(BinaryTree * self, PyObject * target,
+				Node ** found) {
+	NodeStack path;
+	Node * current = self->root;
+	Py_ssize_t version;
+	Key key;
+	int cmp = 1;
+
+	if ( self->balancer->accessed == NULL )
+		return Node_find(self, self->root, target, found);
+
+	if ( BinaryTree_encode(self, target, &key) < 0 ) return -1;
+
+	NodeStack_init(&path);
+	version = self->version;
+
+	while ( current != NULL ) {
+		if ( BinaryTree_compareNode(self, current, target, &key,
+						&cmp) < 0 ||
+			checkVersion(self, version) < 0 ||
+			NodeStack_push(&path, current) < 0 ) {
+			NodeStack_free(&path);
+			BinaryTree_releaseKey(self, &key);
+			return -1;
+		}
+
+		if ( cmp == 0 ) break;
+
+		current = (cmp > 0) ? current->lchild : current->rchild;
+	}
+
+	BinaryTree_releaseKey(self, &key);
+
+	*found = (current != NULL && NODE_IS_DEAD(&self->pool.layout,
+						current)) ? NULL : current;
+
+	if ( path.len > 1 ) {
+		self->balancer->accessed(self, &path);
+		self->version++;
+	}
+
+	NodeStack_free(&path);
+	return 0;
+}
+
+static PyObject * BinaryTree_locate(BinaryTree * self, PyObject * target) {
+	Node * found;
+
+	releasePending();
+
+	if ( BinaryTree_find(self, target, &found) < 0 ) return NULL;
+
+	return Node_wrap(self, found);
+}
+
+/* Applies 'func' to the item in 'node', unless it's a tombstone, checking
+ * that it didn't change 'tree' since 'version'.
+ * Returns 1 on success, -1 on error.
+ */
+static int Node_visit(BinaryTree * tree, Node * node, PyObject * func,
+			Py_ssize_t version) {
+	PyObject * res;
+
+	/* Tombstones are walked past */
+	if ( NODE_IS_DEAD(&tree->pool.layout, node) ) return 1;
+
+	res = PyObject_CallFunctionObjArgs(func, node->item, NULL);
+	if ( res == NULL ) return -1;
+
+	/* The new reference returned by the call won't be used. */
+	Py_DECREF(res);
+
+	if ( checkVersion(tree, version) < 0 ) return -1;
+
+	return 1;
+}
+
+/* Traverses the subtree with root at 'root' in-order applying
+ * 'func' to every item.
+ * The traversals use an explicit stack rather than recursion, as splay
+ * trees can be arbitrarily deep. Node_visit stops them as soon as the tree
+ * changes, so the nodes on the stack stay valid.
+ * Returns 1 on success, -1 on error.
+ */
+static int Node_inOrder(BinaryTree * tree, Node * root, PyObject * func,
+			Py_ssize_t version) {
+	NodeStack stack;
+	Node * current = root;
+
+	NodeStack_init(&stack);
+
+	while ( current != NULL || stack.len > 0 ) {
+		/* Traverse left subtree */
+		while ( current != NULL ) {
+			if ( NodeStack_push(&stack, current) < 0 ) {
+				NodeStack_free(&stack);
+				return -1;
+			}
+
+			current = current->lchild;
+		}
+
+		/* Process this node, then traverse right subtree */
+		current = NODESTACK_POP(&stack);
+		if ( Node_visit(tree, current, func, version) == -1 ) {
+			NodeStack_free(&stack);
+			return -1;
+		}
+
+		current = current->rchild;
+	}
+
+	NodeStack_free(&stack);
+	return 1;
+}
+
+/* Traverses the subtree with root at 'root' in pre-order applying
+ * 'func' to every item.
+ * Returns 1 on success, -1 on error.
+ */
+static int Node_preOrder(BinaryTree * tree, Node * root, PyObject * func,
+			Py_ssize_t version) {
+	NodeStack stack;
+	Node * current;
+
+	NodeStack_init(&stack);
+	if ( root != NULL ) stack.nodes[stack.len++] = root;
+
+	while ( stack.len > 0 ) {
+		/* Process this node */
+		current = NODESTACK_POP(&stack);
+		if ( Node_visit(tree, current, func, version) == -1 )
+			goto fail;
+
+		/* Traverse left subtree, then right subtree */
+		if ( current->rchild != NULL &&
+			NodeStack_push(&stack, current->rchild) < 0 )
+			goto fail;
+
+		if ( current->lchild != NULL &&
+			NodeStack_push(&stack, current->lchild) < 0 )
+			goto fail;
+	}
+
+	NodeStack_free(&stack);
+	return 1;
+
+fail:
+	NodeStack_free(&stack);
+	return -1;
+}
+
+/* Traverses the subtree with root at 'root' in post-order
+ * applying 'func' to every item.
+ * Returns 1 on success, -1 on error.
+ */
+static int Node_postOrder(BinaryTree * tree, Node * root, PyObject * func,
+			Py_ssize_t version) {
+	NodeStack stack;
+	Node * current = root, * top, * last = NULL;
+
+	NodeStack_init(&stack);
+
+	while ( current != NULL || stack.len > 0 ) {
+		/* Traverse left subtree */
+		while ( current != NULL ) {
+			if ( NodeStack_push(&stack, current) < 0 ) {
+				NodeStack_free(&stack);
+				return -1;
+			}
+
+			current = current->lchild;
+		}
+
+		/* Traverse right subtree, unless just done with it */
+		top = stack.nodes[stack.len - 1];
+		if ( top->rchild != NULL && top->rchild != last ) {
+			current = top->rchild;
+			continue;
+		}
+
+		/* Process this node */
+		if ( Node_visit(tree, top, func, version) == -1 ) {
+			NodeStack_free(&stack);
+			return -1;
+		}
+
+		last = NODESTACK_POP(&stack);
+	}
+
+	NodeStack_free(&stack);
+	return 1;
+}
+
+/* Copies 'node' into a new node from 'pool', children included, so that
+ * they still point into the original tree.
+ * Returns the copy, or NULL on failure.
+ */
+static Node * Node_copy(NodePool * pool, Node * node) {
+	Node * copy;
+
+	copy = Node_new(pool);
+	if ( copy == NULL ) return NULL;
+
+	memcpy((void *) copy, (void *) node, pool->layout.size);
+	Py_INCREF(copy->item);
+	if ( pool->layout.fields & NODE_OBJECT_KEYS )
+		Py_XINCREF(NODE_KEY_OBJECT(&pool->layout, copy));
+
+	return copy;
+}
+
+/* Creates a shallow copy of the tree starting at 'root', with nodes taken
+ * from 'pool'. Copied nodes are stacked until their children, which they
+ * still share with the original, are copied in turn.
+ * Returns the new (copied) root or NULL on failure, in which case the nodes
+ * copied so far are left in 'pool'.
+ */
+static Node * Node_copytree(NodePool * pool, Node * root) {
+	NodeStack stack;
+	Node * newroot, * copy;
+
+	newroot = Node_copy(pool, root);
+	if ( newroot == NULL ) return NULL;
+
+	NodeStack_init(&stack);
+	stack.nodes[stack.len++] = newroot;
+
+	while ( stack.len > 0 ) {
+		copy = NODESTACK_POP(&stack);
+
+		if ( copy->lchild != NULL ) {
+			copy->lchild = Node_copy(pool, copy->lchild);
+			if ( copy->lchild == NULL ||
+				NodeStack_push(&stack, copy->lchild) < 0 )
+				goto fail;
+
+			NODE_SET_PARENT(&pool->layout, copy->lchild, copy);
+		}
+
+		if ( copy->rchild != NULL ) {
+			copy->rchild = Node_copy(pool, copy->rchild);
+			if ( copy->rchild == NULL ||
+				NodeStack_push(&stack, copy->rchild) < 0 )
+				goto fail;
+
+			NODE_SET_PARENT(&pool->layout, copy->rchild, copy);
+		}
+	}
+
+	NodeStack_free(&stack);
+	return newroot;
+
+fail:
+	NodeStack_free(&stack);
+	return NULL;
+}
+
+/* Appends the nodes of the tree starting at 'root' to 'out', in-order.
+ * The walk uses an explicit stack, so it is safe on arbitrarily deep trees
+ * and never calls back into the interpreter.
+ * Returns 0 on success, -1 on failure.
+ */
+static int Node_flatten(Node * root, NodeStack * out) {
+	NodeStack stack;
+	Node * current = root;
+
+	NodeStack_init(&stack);
+
+	while ( current != NULL || stack.len > 0 ) {
+		while ( current != NULL ) {
+			if ( NodeStack_push(&stack, current) < 0 ) {
+				NodeStack_free(&stack);
+				return -1;
+			}
+
+			current = current->lchild;
+		}
+
+		current = NODESTACK_POP(&stack);
+		if ( NodeStack_push(out, current) < 0 ) {
+			NodeStack_free(&stack);
+			return -1;
+		}
+
+		current = current->rchild;
+	}
+
+	NodeStack_free(&stack);
+	return 0;
+}
+
+/* Appends to 'path' the way down from 'root' to its first node, if 'forward'
+ * is set, or to its last node otherwise. 'path' must have room for it.
+ */
+static void Node_descend(NodeStack * path, Node * root, int forward) {
+	while ( root != NULL ) {
+		path->nodes[path->len++] = root;
+		root = forward ? root->lchild : root->rchild;
+	}
+
+	return;
+}
+
+/* Moves the last node of 'path' to its in-order successor, if 'forward'
+ * is set, or to its predecessor otherwise, emptying 'path' if there is
+ * none. 'path' must start at the root and have room for the height of the
+ * tree. Walks O(1) nodes in amortized terms.
+ */
+static void Node_step(NodeStack * path, int forward) {
+	Node * node = path->nodes[path->len - 1], * child;
+
+	child = forward ? node->rchild : node->lchild;
+	if ( child != NULL ) {
+		Node_descend(path, child, forward);
+		return;
+	}
+
+	/* Climb until coming up from the near side of an ancestor */
+	do {
+		node = NODESTACK_POP(path);
+		if ( path->len == 0 ) break;
+
+		child = path->nodes[path->len - 1];
+	} while ( (forward ? child->rchild : child->lchild) == node );
+
+	return;
+}
+
+/* Steps 'path' as Node_step does until its last node isn't a tombstone, or
+ * it is empty.
+ */
+static void Node_skipDead(NodeLayout * layout, NodeStack * path,
+				int forward) {
+	while ( path->len > 0 &&
+		NODE_IS_DEAD(layout, path->nodes[path->len - 1]) )
+		Node_step(path, forward);
+
+	return;
+}
+
+/* Returns the in-order successor of 'node', if 'forward' is set, or its
+ * predecessor otherwise, or NULL if there is none. Nodes must keep parent
+ * pointers. Walks O(1) nodes in amortized terms.
+ */
+static Node * Node_neighbour(NodeLayout * layout, Node * node, int forward) {
+	Node * next, * parent;
+
+	next = forward ? node->rchild : node->lchild;
+	if ( next != NULL ) {
+		while ( (forward ? next->lchild : next->rchild) != NULL )
+			next = forward ? next->lchild : next->rchild;
+
+		return next;
+	}
+
+	/* Climb until coming up from the near side of an ancestor */
+	parent = NODE_PARENT(layout, node);
+	while ( parent != NULL &&
+		(forward ? parent->rchild : parent->lchild) == node ) {
+		node = parent;
+		parent = NODE_PARENT(layout, node);
+	}
+
+	return parent;
+}
+
+/* Returns the item node of in-order rank 'rank', counting from 0 and
+ * skipping tombstones, in the subtree at 'root', which must hold more
+ * items than 'rank'. Nodes must keep subtree sizes.
+ */
+static Node * Node_select(NodeLayout * layout, Node * root, Py_ssize_t rank) {
+	Py_ssize_t left;
+	int live;
+
+	for (;;) {
+		left = NODE_SUBTREE_COUNT(layout, root->lchild);
+		live = !NODE_IS_DEAD(layout, root);
+
+		if ( rank == left && live ) return root;
+
+		if ( rank < left ) {
+			root = root->lchild;
+		} else {
+			rank -= left + live;
+			root = root->rchild;
+		}
+	}
+}
+
+/* Links the 'n' sorted nodes in 'nodes' into a perfectly balanced tree,
+ * fixing heights and balances bottom-up, and giving treap nodes priorities
+ * in heap order. Every node's children are
+ * overwritten, as are the parents of all but the root. No comparisons are
+ * made.
+ * Returns the new root (NULL if n is 0).
+ */
+static Node * Node_buildBalanced(NodeLayout * layout, Node ** nodes,
+					Py_ssize_t n) {
+	Node * root;
+	Py_ssize_t mid;
+
+	if ( n <= 0 ) return NULL;
+
+	mid = n / 2;
+	root = nodes[mid];
+
+	/* The recursion depth is logarithmic in n, so there's no need
+	 * to guard it. */
+	root->lchild = Node_buildBalanced(layout, nodes, mid);
+	root->rchild = Node_buildBalanced(layout, nodes + mid + 1, n - mid - 1);
+	NODE_SET_PARENT(layout, root->lchild, root);
+	NODE_SET_PARENT(layout, root->rchild, root);
+
+	Node_updateHeight(layout, root);
+	NODE_UPDATE_BALANCE(layout, root);
+	NODE_UPDATE_COUNT(layout, root);
+	if ( layout->priority != 0 )
+		NODE_PRIORITY(layout, root) =
+			treapPriority(NODE_HEIGHT(layout, root));
+
+	return root;
+}
+
+/* Flattens the subtree at 'root' into a vine, a list of its nodes in order
+ * linked through their 'rchild', by rotating left children up until there
+ * are none, without allocating.
+ * Returns the first node of the vine.
+ */
+static Node * Node_toVine(Node * root) {
+	Node * head = NULL, ** tail = &head, * node = root, * child;
+
+	while ( node != NULL ) {
+		if ( node->lchild != NULL ) {
+			child = node->lchild;
+			node->lchild = child->rchild;
+			child->rchild = node;
+			node = child;
+		} else {
+			*tail = node;
+			tail = &node->rchild;
+			node = node->rchild;
+		}
+	}
+
+	return head;
+}
+
+/* Links the first 'n' nodes of the vine at '*head' into a perfectly
+ * balanced tree, as Node_buildBalanced does with an array, advancing
+ * '*head' past them.
+ * Returns the new root (NULL if n is 0).
+ */
+static Node * Node_buildFromVine(NodeLayout * layout, Node ** head,
+					Py_ssize_t n) {
+	Node * root, * left;
+
+	if ( n <= 0 ) return NULL;
+
+	left = Node_buildFromVine(layout, head, n / 2);
+	root = *head;
+	*head = root->rchild;
+
+	root->lchild = left;
+	root->rchild = Node_buildFromVine(layout, head, n - n / 2 - 1);
+	NODE_SET_PARENT(layout, root->lchild, root);
+	NODE_SET_PARENT(layout, root->rchild, root);
+
+	Node_updateHeight(layout, root);
+	NODE_UPDATE_BALANCE(layout, root);
+	NODE_UPDATE_COUNT(layout, root);
+	if ( layout->priority != 0 )
+		NODE_PRIORITY(layout, root) =
+			treapPriority(NODE_HEIGHT(layout, root));
+
+	return root;
+}
+
+/* Returns the number of nodes in the subtree at 'root', tombstones
+ * included. Unless nodes keep subtree sizes, and have no tombstones left
+ * out of them, they are counted with a Morris traversal, which threads
+ * the subtree through its empty right children as it goes and restores it
+ * afterwards, so nothing is allocated.
+ */
+static Py_ssize_t Node_size(NodeLayout * layout, Node * root) {
+	Node * node = root, * pred;
+	Py_ssize_t n = 0;
+
+	if ( layout->count != 0 && layout->dead == 0 )
+		return NODE_SUBTREE_COUNT(layout, root);
+
+	while ( node != NULL ) {
+		if ( node->lchild == NULL ) {
+			n++;
+			node = node->rchild;
+			continue;
+		}
+
+		pred = node->lchild;
+		while ( pred->rchild != NULL && pred->rchild != node )
+			pred = pred->rchild;
+
+		if ( pred->rchild == NULL ) {
+			pred->rchild = node;
+			node = node->lchild;
+		} else {
+			pred->rchild = NULL;
+			n++;
+			node = node->rchild;
+		}
+	}
+
+	return n;
+}
+
+/* Traverses the binary tree in-order, applying 'func' to every item.
+ * Returns None on success, NULL on failure.
+ */
+static PyObject * BinaryTree_inOrder(BinaryTree * self, PyObject * func) {
+	if ( Node_inOrder(self, self->root, func, self->version) == 1 ) {
+		Py_RETURN_NONE;
+	}
+
+	return NULL;
+}
+
+/* Traverses the binary tree in pre-order, applying 'func' to every item.
+ * Returns None on success, NULL on failure.
+ */
+static PyObject * BinaryTree_preOrder(BinaryTree * self, PyObject * func) {
+	if ( Node_preOrder(self, self->root, func, self->version) == 1 ) {
+		Py_RETURN_NONE;
+	}
+
+	return NULL;
+}
+
+/* Traverses the binary tree in post-order, applying 'func' to every item.
+ * Returns None on success, NULL on failure.
+ */
+static PyObject * BinaryTree_postOrder(BinaryTree * self, PyObject * func) {
+	if ( Node_postOrder(self, self->root, func, self->version) == 1) {
+		Py_RETURN_NONE;
+	}
+
+	return NULL;
+}
+
+/* Appends to 'path' the ancestors of 'node', from the root down, found
+ * through parent pointers, or else by descending by the node's key, which
+ * makes no calls into the interpreter. 'path' must have room for them.
+ */
+static void BinaryTree_pathTo(BinaryTree * self, Node * node,
+				NodeStack * path) {
+	NodeLayout * layout = &self->pool.layout;
+	Node * current;
+	Py_ssize_t i;
+
+	if ( layout->parent != 0 ) {
+		for ( current = NODE_PARENT(layout, node); current != NULL;
+				current = NODE_PARENT(layout, current) )
+			path->len++;
+
+		i = path->len;
+		for ( current = NODE_PARENT(layout, node); current != NULL;
+				current = NODE_PARENT(layout, current) )
+			path->nodes[--i] = current;
+
+		return;
+	}
+
+	for ( current = self->root; current != node; ) {
+		path->nodes[path->len++] = current;
+		current = (self->keys->compare(NODE_KEY(layout, current),
+					NODE_KEY(layout, node)) > 0) ?
+				current->lchild : current->rchild;
+	}
+
+	return;
+}
+
+/* Applies sorted batches of 'ni' insertions, without duplicates, and 'nr'
+ * removals item by item, which beats rebuilding the tree for batches much
+ * smaller than it. 'ik' and 'rk' are their integer keys, or NULL.
+ * Every item is located first, which makes all the comparisons. Nodes are
+ * then linked in, revived, unlinked or buried without any, finding their
+ * ancestors again as BinaryTree_pathTo does: new nodes go next to their
+ * successors, which insertions in descending order leave in place.
+ * The tree is left unchanged on failure. Takes O(k log n) for k items.
+ * Returns 0 on success, -1 on failure.
+ */
+static int BinaryTree_applyInPlace(BinaryTree * self, PyObject ** iv,
+				PY_LONG_LONG * ik, Py_ssize_t ni,
+				PyObject ** rv, PY_LONG_LONG * rk,
+				Py_ssize_t nr) {
+	NodeLayout * layout = &self->pool.layout;
+	PyObject ** released = NULL, * item;
+	Node ** found = NULL, ** anchors, ** removed, * node, * anchor;
+	Node * prev = NULL, * prevanchor = NULL;
+	NodeStack path, fresh;
+	Key * keys = NULL;
+	PY_LONG_LONG key;
+	Py_ssize_t i, r, k, nk = 0, nreleased = 0, version;
+	int cmp = 1;
+
+	NodeStack_init(&path);
+	NodeStack_init(&fresh);
+
+	/* Insertions of items that are also removed come to nothing */
+	for ( i = r = k = 0; i < ni; i++ ) {
+		while ( r < nr ) {
+			if ( compareBatch(rv[r], rk != NULL ? &rk[r] : NULL,
+					iv[i], ik != NULL ? &ik[i] : NULL,
+					&cmp) < 0 )
+				return -1;
+			if ( cmp >= 0 ) break;
+			r++;
+		}
+
+		if ( r < nr && cmp == 0 ) continue;
+
+		item = iv[k];
+		iv[k] = iv[i];
+		iv[i] = item;
+		if ( ik != NULL ) {
+			key = ik[k];
+			ik[k] = ik[i];
+			ik[i] = key;
+		}
+		k++;
+	}
+	ni = k;
+
+	found = PyMem_New(Node *, 2 * ni + nr + 1);
+	released = PyMem_New(PyObject *, ni + nr + 1);
+	if ( self->keys != NULL ) keys = PyMem_New(Key, ni + nr + 1);
+	if ( found == NULL || released == NULL ||
+		(self->keys != NULL && keys == NULL) ) {
+		PyErr_NoMemory();
+		goto fail;
+	}
+
+	anchors = found + ni;
+	removed = found + 2 * ni;
+
+	version = self->version;
+	for ( i = 0; keys != NULL && i < ni + nr; i++ ) {
+		if ( ik != NULL ) {
+			memcpy(&keys[i], i < ni ? &ik[i] : &rk[i - ni],
+				sizeof(PY_LONG_LONG));
+		} else if ( BinaryTree_encode(self, i < ni ? iv[i] : rv[i - ni],
+						&keys[i]) < 0 ) {
+			goto fail;
+		} else {
+			nk++;
+		}
+	}
+
+	/* Find where every item is, or the successor of its place */
+	for ( i = 0; i < ni + nr; i++ ) {
+		item = (i < ni) ? iv[i] : rv[i - ni];
+		node = self->root;
+		anchor = NULL;
+
+		while ( node != NULL ) {
+			if ( BinaryTree_compareNode(self, node, item,
+					keys != NULL ? &keys[i] : NULL,
+					&cmp) < 0 ||
+				checkVersion(self, version) < 0 )
+				goto fail;
+
+			if ( cmp == 0 ) break;
+
+			if ( cmp > 0 ) {
+				anchor = node;
+				node = node->lchild;
+			} else {
+				node = node->rchild;
+			}
+		}
+
+		if ( i < ni ) {
+			found[i] = node;
+			anchors[i] = anchor;
+			continue;
+		}
+
+		/* Duplicate removals find the same node */
+		if ( node == NULL || NODE_IS_DEAD(layout, node) ||
+			node == prev ) {
+			removed[i - ni] = NULL;
+		} else {
+			removed[i - ni] = node;
+			prev = node;
+		}
+	}
+
+	if ( checkVersion(self, version) < 0 ||
+		NodeStack_reserve(&path, BinaryTree_height(self) +
+					2 * (ni + nr) + 2) < 0 ||
+		NodeStack_reserve(&fresh, ni) < 0 ) {
+		if (! PyErr_Occurred() ) PyErr_NoMemory();
+		goto fail;
+	}
+
+	for ( i = 0; i < ni; i++ ) {
+		if ( found[i] != NULL ) continue;
+
+		node = Node_new(&self->pool);
+		if ( node == NULL ) goto fail;
+
+		Py_INCREF(iv[i]);
+		node->item = iv[i];
+		fresh.nodes[fresh.len++] = node;
+
+		/* The node takes over the key */
+		if ( keys != NULL ) {
+			memcpy(NODE_KEY(layout, node), &keys[i],
+				layout->keysize);
+			if ( layout->fields & NODE_OBJECT_KEYS )
+				keys[i].object = NULL;
+		}
+	}
+
+	/* No more failures from here on. A new node's successor is the node
+	 * its search ended next to, unless the node inserted just before,
+	 * greater than it, ended next to the same one. */
+	prev = NULL;
+	k = fresh.len;
+	for ( i = ni - 1; i >= 0; i-- ) {
+		path.len = 0;
+		node = found[i];
+
+		if ( node != NULL ) {
+			if (! NODE_IS_DEAD(layout, node) ) continue;
+
+			/* A tombstone takes the item back in its place */
+			BinaryTree_pathTo(self, node, &path);
+			path.nodes[path.len++] = node;
+			released[nreleased++] = node->item;
+			Py_INCREF(iv[i]);
+			node->item = iv[i];
+			NODE_DEAD(layout, node) = 0;
+			if ( layout->count != 0 ) {
+				for ( r = 0; r < path.len; r++ )
+					NODE_COUNT(layout, path.nodes[r])++;
+			}
+			self->dead--;
+			continue;
+		}
+
+		node = fresh.nodes[--k];
+		anchor = (prev != NULL && anchors[i] == prevanchor) ?
+				prev : anchors[i];
+		prev = node;
+		prevanchor = anchors[i];
+
+		if ( anchor == NULL ) {
+			Node_descend(&path, self->root, 0);
+			path.nodes[path.len - 1]->rchild = node;
+		} else {
+			BinaryTree_pathTo(self, anchor, &path);
+			path.nodes[path.len++] = anchor;
+			if ( anchor->lchild == NULL ) {
+				anchor->lchild = node;
+			} else {
+				Node_descend(&path, anchor->lchild, 0);
+				path.nodes[path.len - 1]->rchild = node;
+			}
+		}
+
+		NODE_SET_PARENT(layout, node, path.nodes[path.len - 1]);
+		if ( layout->count != 0 ) {
+			for ( r = 0; r < path.len; r++ )
+				NODE_COUNT(layout, path.nodes[r])++;
+		}
+
+		path.nodes[path.len++] = node;
+		self->balancer->inserted(self, &path);
+	}
+
+	for ( r = 0; r < nr; r++ ) {
+		if ( removed[r] == NULL ) continue;
+
+		path.len = 0;
+		BinaryTree_pathTo(self, removed[r], &path);
+		item = (layout->dead != 0) ?
+			BinaryTree_bury(self, &path, removed[r]) :
+			BinaryTree_unlinkNode(self, &path, removed[r]);
+		if ( item != NULL ) released[nreleased++] = item;
+	}
+
+	if ( layout->dead != 0 ) BinaryTree_prune(self);
+	self->version++;
+
+	/* Only release items once the tree is consistent again, as that may
+	 * run arbitrary code. */
+	for ( i = 0; i < nreleased; i++ )
+		Py_DECREF(released[i]);
+
+	for ( i = 0; i < nk; i++ )
+		BinaryTree_releaseKey(self, &keys[i]);
+
+	PyMem_Free(found);
+	PyMem_Free(released);
+	PyMem_Free(keys);
+	NodeStack_free(&path);
+	NodeStack_free(&fresh);
+
+	return 0;
+
+fail:
+	for ( i = 0; i < fresh.len; i++ ) {
+		item = fresh.nodes[i]->item;
+		NodePool_free(&self->pool, fresh.nodes[i]);
+		Py_DECREF(item);
+	}
+
+	for ( i = 0; i < nk; i++ )
+		BinaryTree_releaseKey(self, &keys[i]);
+
+	PyMem_Free(found);
+	PyMem_Free(released);
+	PyMem_Free(keys);
+	NodeStack_free(&path);
+	NodeStack_free(&fresh);
+
+	return -1;
+}
+
+/* Applies a batch of insertions and removals in a single pass.
+ * Both batches are sorted first. Batches much smaller than the tree are
+ * then applied item by item, as BinaryTree_applyInPlace does, when the
+ * nodes they touch can be found again through parent pointers or keys.
+ * Otherwise, they are merged with the in-order list of nodes already in
+ * the tree, and the surviving nodes are relinked into a balanced tree,
+ * fixing heights and balances once, bottom-up.
+ * Every comparison happens before the tree is touched, so the tree is left
+ * unchanged if any of them fails.
+ * Takes O(k log n) for a tree of n nodes and a small batch of k items, or
+ * else O(n + k log k), or O(n + k) in trees with integer keys, whose
+ * batches are radix sorted and merged by key. 'removes' may be NULL for a
+ * batch of insertions alone.
+ * Returns 0 on success, -1 on failure.
+ */
+static int BinaryTree_apply(BinaryTree * self, PyObject * inserts,
+				PyObject * removes) {
+	PyObject * ins = NULL, * rem = NULL;
+	PyObject ** iv, ** rv, ** released = NULL, * item;
+	PY_LONG_LONG * ik = NULL, * rk = NULL, key = 0;
+	NodeStack nodes, kept, dropped, fresh;
+	Py_ssize_t ni, nr, i, j, k, r, version;
+	Node * node;
+	int cmp, integers = (self->keys != NULL && self->keys->integers);
+
+	releasePending();
+
+	/* Private copies, so that neither comparisons nor the caller can
+	 * change the batches under us. */
+	ins = PySequence_List(inserts);
+	if ( ins == NULL ) return -1;
+
+	rem = (removes != NULL) ? PySequence_List(removes) : PyList_New(0);
+	if ( rem == NULL ) {
+		Py_DECREF(ins);
+		return -1;
+	}
+
+	iv = PySequence_Fast_ITEMS(ins);
+	ni = PyList_GET_SIZE(ins);
+	rv = PySequence_Fast_ITEMS(rem);
+	nr = PyList_GET_SIZE(rem);
+
+	NodeStack_init(&nodes);
+	NodeStack_init(&kept);
+	NodeStack_init(&dropped);
+	NodeStack_init(&fresh);
+
+	if ( integers ) {
+		if ( BinaryTree_sortIntegers(self, iv, ni, &ik) < 0 ||
+			BinaryTree_sortIntegers(self, rv, nr, &rk) < 0 )
+			goto fail;
+	} else if ( sortItems(iv, ni) < 0 || sortItems(rv, nr) < 0 ) {
+		goto fail;
+	}
+
+	/* Drop duplicate insertions */
+	for ( i = 1, k = (ni > 0); i < ni; i++ ) {
+		if ( compareBatch(iv[k - 1], integers ? &ik[k - 1] : NULL,
+					iv[i], integers ? &ik[i] : NULL,
+					&cmp) < 0 )
+			goto fail;
+
+		if ( cmp != 0 ) {
+			item = iv[k];
+			iv[k] = iv[i];
+			iv[i] = item;
+			if ( integers ) {
+				key = ik[k];
+				ik[k] = ik[i];
+				ik[i] = key;
+			}
+			k++;
+		}
+	}
+	ni = k;
+
+	if ( self->root != NULL &&
+		(self->pool.layout.parent != 0 || self->keys != NULL) &&
+		(ni + nr) * BinaryTree_height(self) <= self->pool.size ) {
+		if ( BinaryTree_applyInPlace(self, iv, ik, ni, rv, rk, nr) < 0 )
+			goto fail;
+
+		goto done;
+	}
+
+	version = self->version;
+	if ( Node_flatten(self->root, &nodes) < 0 ) goto fail;
+
+	/* Merge the tree with the insertions, filtering out removals.
+	 * Kept insertions are moved to the front of the batch, and stand
+	 * as NULL in 'kept' until they get their nodes. */
+	i = j = k = r = 0;
+	while ( i < nodes.len || j < ni ) {
+		/* Tombstones are dropped with the removals, which purges
+		 * them only once every comparison succeeded */
+		if ( i < nodes.len &&
+			NODE_IS_DEAD(&self->pool.layout, nodes.nodes[i]) ) {
+			if ( NodeStack_push(&dropped, nodes.nodes[i++]) < 0 )
+				goto fail;
+
+			continue;
+		}
+
+		if ( j == ni ) {
+			cmp = -1;
+		} else if ( i == nodes.len ) {
+			cmp = 1;
+		} else if ( compareBatch(nodes.nodes[i]->item,
+				integers ? NODE_KEY(&self->pool.layout,
+						nodes.nodes[i]) : NULL,
+				iv[j], integers ? &ik[j] : NULL, &cmp) < 0 ||
+				checkVersion(self, version) < 0 ) {
+			goto fail;
+		}
+
+		/* Insertions of items already in the tree are no-ops */
+		node = (cmp <= 0) ? nodes.nodes[i++] : NULL;
+		item = (cmp <= 0) ? node->item : iv[j];
+		if ( integers ) {
+			key = (cmp <= 0) ? *(PY_LONG_LONG *)
+				NODE_KEY(&self->pool.layout, node) : ik[j];
+		}
+		if ( cmp >= 0 ) j++;
+
+		while ( r < nr ) {
+			if ( compareBatch(rv[r], integers ? &rk[r] : NULL,
+					item, integers ? &key : NULL,
+					&cmp) < 0 ||
+				checkVersion(self, version) < 0 )
+				goto fail;
+			if ( cmp >= 0 ) break;
+			r++;
+		}
+
+		if ( r < nr && cmp == 0 ) {
+			if ( node != NULL && NodeStack_push(&dropped, node) < 0 )
+				goto fail;
+
+			continue;
+		}
+
+		if ( node == NULL ) {
+			iv[j - 1] = iv[k];
+			iv[k] = item;
+			if ( integers ) {
+				ik[j - 1] = ik[k];
+				ik[k] = key;
+			}
+			k++;
+		}
+
+		if ( NodeStack_push(&kept, node) < 0 ) goto fail;
+	}
+
+	/* All comparisons are done, so nothing can touch the tree behind
+	 * our backs while the new nodes are allocated. */
+	if ( NodeStack_reserve(&fresh, k) < 0 ) {
+		PyErr_NoMemory();
+		goto fail;
+	}
+
+	for ( i = 0, j = 0; i < kept.len; i++ ) {
+		if ( kept.nodes[i] != NULL ) continue;
+
+		node = Node_new(&self->pool);
+		if ( node == NULL ) goto fail;
+
+		Py_INCREF(iv[j]);
+		node->item = iv[j];
+		kept.nodes[i] = node;
+		fresh.nodes[fresh.len++] = node;
+
+		/* Other keys are only encoded once every comparison
+		 * succeeded, as their order is that of the items */
+		if ( integers ) {
+			memcpy(NODE_KEY(&self->pool.layout, node), &ik[j],
+				sizeof(PY_LONG_LONG));
+		} else if ( self->keys != NULL &&
+			(BinaryTree_encode(self, node->item,
+				NODE_KEY(&self->pool.layout, node)) < 0 ||
+			checkVersion(self, version) < 0) ) {
+			goto fail;
+		}
+
+		j++;
+	}
+
+	if ( dropped.len > 0 ) {
+		released = PyMem_New(PyObject *, dropped.len);
+		if ( released == NULL ) {
+			PyErr_NoMemory();
+			goto fail;
+		}
+	}
+
+	/* No more failures from here on */
+	self->root = Node_buildBalanced(&self->pool.layout, kept.nodes, kept.len);
+	NODE_SET_PARENT(&self->pool.layout, self->root, NULL);
+	self->peak = kept.len;
+	self->dead = 0;
+	self->version++;
+
+	for ( i = 0; i < dropped.len; i++ ) {
+		released[i] = dropped.nodes[i]->item;
+		NodePool_free(&self->pool, dropped.nodes[i]);
+	}
+
+	if ( dropped.len > 0 ) self->epoch++;
+
+	/* Only release removed items once the tree is consistent again, as
+	 * that may run arbitrary code. */
+	for ( i = 0; i < dropped.len; i++ )
+		Py_DECREF(released[i]);
+
+done:
+	PyMem_Free(released);
+	PyMem_Free(ik);
+	PyMem_Free(rk);
+	NodeStack_free(&nodes);
+	NodeStack_free(&kept);
+	NodeStack_free(&dropped);
+	NodeStack_free(&fresh);
+	Py_DECREF(ins);
+	Py_DECREF(rem);
+
+	return 0;
+
+fail:
+	for ( i = 0; i < fresh.len; i++ ) {
+		item = fresh.nodes[i]->item;
+		NodePool_free(&self->pool, fresh.nodes[i]);
+		Py_DECREF(item);
+	}
+
+	PyMem_Free(released);
+	PyMem_Free(ik);
+	PyMem_Free(rk);
+	NodeStack_free(&nodes);
+	NodeStack_free(&kept);
+	NodeStack_free(&dropped);
+	NodeStack_free(&fresh);
+	Py_DECREF(ins);
+	Py_DECREF(rem);
+
+	return -1;
+}
+
+static PyObject * BinaryTree_applyBatch(BinaryTree * self, PyObject * args) {
+	PyObject * inserts, * removes;
+
+	if (! PyArg_ParseTuple(args, "OO:apply_batch", &inserts, &removes) )
+		return NULL;
+
+	if ( BinaryTree_apply(self, inserts, removes) < 0 ) return NULL;
+
+	Py_RETURN_NONE;
+}
+
+/* Returns a Node handle to the root of the subtree, or None if it's empty.
+ * A tombstone at the root is returned as is, holding None.
+ */
+static PyObject * Subtree_root(Subtree * self) {
+	if ( checkEpoch(self->tree, self->epoch) < 0 ) return NULL;
+
+	return Node_wrap(self->tree, self->root);
+}
+
+static PyObject * Subtree_locate(Subtree * self, PyObject * target) {
+	if ( checkEpoch(self->tree, self->epoch) < 0 ) return NULL;
+
+	return Node_locate(self->tree, self->root, target);
+}
+
+/* Traverses the subtree in-order, applying 'func' to every item.
+ * Returns None on success, NULL on failure.
+ */
+static PyObject * Subtree_inOrder(Subtree * self, PyObject * func) {
+	if ( checkEpoch(self->tree, self->epoch) < 0 ) return NULL;
+
+	if ( Node_inOrder(self->tree, self->root, func,
+				self->tree->version) == 1 ) {
+		Py_RETURN_NONE;
+	}
+
+	return NULL;
+}
+
+/* Traverses the subtree in pre-order, applying 'func' to every item.
+ * Returns None on success, NULL on failure.
+ */
+static PyObject * Subtree_preOrder(Subtree * self, PyObject * func) {
+	if ( checkEpoch(self->tree, self->epoch) < 0 ) return NULL;
+
+	if ( Node_preOrder(self->tree, self->root, func,
+				self->tree->version) == 1 ) {
+		Py_RETURN_NONE;
+	}
+
+	return NULL;
+}
+
+/* Traverses the subtree in post-order, applying 'func' to every item.
+ * Returns None on success, NULL on failure.
+ */
+static PyObject * Subtree_postOrder(Subtree * self, PyObject * func) {
+	if ( checkEpoch(self->tree, self->epoch) < 0 ) return NULL;
+
+	if ( Node_postOrder(self->tree, self->root, func,
+				self->tree->version) == 1 ) {
+		Py_RETURN_NONE;
+	}
+
+	return NULL;
+}
+
+/* Copies the contents of a Subtree into a BinaryTree.
+ * Returns a reference to the new BinaryTree or NULL upon
+ * failure.
+ */
+static PyObject * Subtree_maketree(Subtree * self) {
+	BinaryTree * new;
+	NodeStack nodes;
+	Py_ssize_t i;
+
+	if ( checkEpoch(self->tree, self->epoch) < 0 ) return NULL;
+
+	new = (BinaryTree *) PyType_GenericAlloc(&BinaryTreeType, 0);
+	if ( new == NULL ) return NULL;
+
+	new->pool.layout = self->tree->pool.layout;
+	new->balancer = self->tree->balancer;
+	new->peak = self->tree->peak;
+	new->tombstones = self->tree->tombstones;
+	new->keys = self->tree->keys;
+
+	if ( self->root ) {
+		new->root = Node_copytree(&new->pool, self->root);
+		if ( new->root == NULL ) {
+			Py_DECREF(new);
+			return NULL;
+		}
+
+		NODE_SET_PARENT(&new->pool.layout, new->root, NULL);
+	}
+
+	/* Tombstones are copied along, and purged from the copy */
+	if ( new->pool.layout.dead != 0 && new->root != NULL ) {
+		NodeStack_init(&nodes);
+		if ( Node_flatten(new->root, &nodes) < 0 ) {
+			NodeStack_free(&nodes);
+			Py_DECREF(new);
+			return PyErr_NoMemory();
+		}
+
+		for ( i = 0; i < nodes.len; i++ )
+			new->dead += NODE_IS_DEAD(&new->pool.layout,
+							nodes.nodes[i]);
+		NodeStack_free(&nodes);
+
+		if ( BinaryTree_purge(new) < 0 ) {
+			Py_DECREF(new);
+			return NULL;
+		}
+	}
+
+	return (PyObject *) new;
+}
+
+/* Returns a new Cursor over the tree, at the first item not less than the
+ * optional key, or at the first item.
+ * Returns NULL on failure.
+ */
+static PyObject * BinaryTree_cursor(BinaryTree * self, PyObject * args) {
+	PyObject * key = NULL;
+
+	if (! PyArg_ParseTuple(args, "|O:cursor", &key) )
+		return NULL;
+
+	releasePending();
+
+	return Cursor_new(self, &CursorType, key);
+}
+
+/* Returns an iterator over the items of the tree, in-order. The iterator
+ * walks the tree itself rather than a copy, and raises RuntimeError if the
+ * tree changes while it is in use.
+ */
+static PyObject * BinaryTree_iter(BinaryTree * self) {
+	releasePending();
+
+	return Cursor_new(self, &IteratorType, NULL);
+}
+
+/* Collects the items of up to 'limit' nodes, starting at the last node of
+ * 'path' and stepping forward or backward as Node_step does, past
+ * tombstones.
+ * Returns a new list, or NULL on failure.
+ */
+static PyObject * BinaryTree_collect(BinaryTree * self, NodeStack * path,
+					int forward, Py_ssize_t limit) {
+	PyObject * items;
+	Py_ssize_t version = self->version;
+
+	items = PyList_New(0);
+	if ( items == NULL ) return NULL;
+
+	/* Appending may run the garbage collector, and with it arbitrary
+	 * code, so the tree is checked on every step. */
+	Node_skipDead(&self->pool.layout, path, forward);
+	while ( path->len > 0 && PyList_GET_SIZE(items) < limit ) {
+		if ( PyList_Append(items, path->nodes[path->len - 1]->item) < 0 ||
+			checkVersion(self, version) < 0 ) {
+			Py_DECREF(items);
+			return NULL;
+		}
+
+		Node_step(path, forward);
+		Node_skipDead(&self->pool.layout, path, forward);
+	}
+
+	return items;
+}
+
+/* Returns the 'k' smallest items, if 'forward' is set, or else the 'k'
+ * largest ones, walking in from the corresponding end of the tree in
+ * O(log n + k).
+ * Returns a new list, or NULL on failure.
+ */
+static PyObject * BinaryTree_extremes(BinaryTree * self, PyObject * arg,
+					int forward) {
+	PyObject * items;
+	NodeStack path;
+	Py_ssize_t k;
+
+	k = PyNumber_AsSsize_t(arg, PyExc_OverflowError);
+	if ( k == -1 && PyErr_Occurred() != NULL ) return NULL;
+
+	if ( k < 0 ) {
+		PyErr_SetString(PyExc_ValueError,
+			"number of items must not be negative");
+		return NULL;
+	}
+
+	releasePending();
+
+	NodeStack_init(&path);
+	if ( self->root != NULL &&
+		NodeStack_reserve(&path, BinaryTree_height(self)) < 0 ) {
+		NodeStack_free(&path);
+		return PyErr_NoMemory();
+	}
+
+	Node_descend(&path, self->root, forward);
+	items = BinaryTree_collect(self, &path, forward, k);
+
+	NodeStack_free(&path);
+	return items;
+}
+
+static PyObject * BinaryTree_smallest(BinaryTree * self, PyObject * arg) {
+	return BinaryTree_extremes(self, arg, 1);
+}
+
+static PyObject * BinaryTree_largest(BinaryTree * self, PyObject * arg) {
+	return BinaryTree_extremes(self, arg, 0);
+}
+
+/* Advances the splitmix64 generator at 'state', returning its next output.
+ * It is fast, and random enough for sampling.
+ */
+static unsigned PY_LONG_LONG nextRandom(unsigned PY_LONG_LONG * state) {
+	unsigned PY_LONG_LONG z;
+
+	z = (*state += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+
+	return z ^ (z >> 31);
+}
+
+/* Returns a uniformly distributed integer in [0, n), for positive 'n' */
+static Py_ssize_t randomBelow(unsigned PY_LONG_LONG * state, Py_ssize_t n) {
+	unsigned PY_LONG_LONG limit, r;
+
+	/* Reject the outputs of the last, incomplete run of 'n' values */
+	limit = (unsigned PY_LONG_LONG) -1;
+	limit -= limit % (unsigned PY_LONG_LONG) n;
+
+	do {
+		r = nextRandom(state);
+	} while ( r >= limit );
+
+	return (Py_ssize_t) (r % (unsigned PY_LONG_LONG) n);
+}
+
+/* Adds 'rank' to the set in 'table', a hash table with 'mask' + 1 slots
+ * and linear probing, in which -1 marks free slots.
+ * Returns 1 if 'rank' was added, 0 if it was already in the set.
+ */
+static int rankSetAdd(Py_ssize_t * table, Py_ssize_t mask, Py_ssize_t rank) {
+	Py_ssize_t slot;
+
+	slot = (Py_ssize_t) (((size_t) rank * 2654435761u) & (size_t) mask);
+	while ( table[slot] != -1 ) {
+		if ( table[slot] == rank ) return 0;
+		slot = (slot + 1) & mask;
+	}
+
+	table[slot] = rank;
+	return 1;
+}
+
+/* Draws 'k' random items, each found by rank in O(log n).
+ * Without replacement, distinct ranks are drawn with Floyd's algorithm and
+ * then shuffled, as the algorithm doesn't draw them in random order.
+ * Returns a new list, or NULL on failure.
+ */
+static PyObject * BinaryTree_sample(BinaryTree * self, PyObject * args,
+					PyObject * kwds) {
+	static char * kwlist[] = {"k", "seed", "replace", NULL};
+	NodeLayout * layout = &self->pool.layout;
+	PyObject * seed = Py_None, * replace = NULL, * items, * index;
+	Py_ssize_t k, n, i, j, rank, mask, * ranks, * table;
+	unsigned PY_LONG_LONG state;
+	int replacement = 0;
+
+	if (! PyArg_ParseTupleAndKeywords(args, kwds, "n|OO:sample", kwlist,
+						&k, &seed, &replace) )
+		return NULL;
+
+	if ( replace != NULL && (replacement = PyObject_IsTrue(replace)) < 0 )
+		return NULL;
+
+	if ( checkCounts(self) < 0 ) return NULL;
+
+	releasePending();
+
+	n = NODE_SUBTREE_COUNT(layout, self->root);
+	if ( k < 0 || (replacement ? (k > 0 && n == 0) : k > n) ) {
+		PyErr_SetString(PyExc_ValueError,
+			"sample larger than the tree or negative");
+		return NULL;
+	}
+
+	if ( seed == Py_None ) {
+		state = nextRandom(&random_state);
+	} else {
+		/* The seed's low 64 bits, as hashes of distinct integers
+		 * collide */
+		index = PyNumber_Index(seed);
+		if ( index == NULL ) return NULL;
+
+		state = PyInt_Check(index) ?
+			PyInt_AsUnsignedLongLongMask(index) :
+			PyLong_AsUnsignedLongLongMask(index);
+		Py_DECREF(index);
+		if ( state == (unsigned PY_LONG_LONG) -1 &&
+			PyErr_Occurred() != NULL )
+			return NULL;
+	}
+
+	ranks = PyMem_New(Py_ssize_t, k > 0 ? k : 1);
+	if ( ranks == NULL ) return PyErr_NoMemory();
+
+	if ( replacement ) {
+		for ( i = 0; i < k; i++ )
+			ranks[i] = randomBelow(&state, n);
+	} else {
+		for ( mask = 1; mask < 2 * k; mask *= 2 );
+
+		table = PyMem_New(Py_ssize_t, mask);
+		if ( table == NULL ) {
+			PyMem_Free(ranks);
+			return PyErr_NoMemory();
+		}
+
+		memset(table, -1, mask * sizeof(Py_ssize_t));
+		mask--;
+
+		for ( i = 0, j = n - k; j < n; i++, j++ ) {
+			rank = randomBelow(&state, j + 1);
+			if (! rankSetAdd(table, mask, rank) ) {
+				rankSetAdd(table, mask, j);
+				rank = j;
+			}
+
+			ranks[i] = rank;
+		}
+
+		PyMem_Free(table);
+
+		for ( i = k - 1; i > 0; i-- ) {
+			j = randomBelow(&state, i + 1);
+			rank = ranks[i];
+			ranks[i] = ranks[j];
+			ranks[j] = rank;
+		}
+	}
+
+	items = PyList_New(k);
+	if ( items != NULL ) {
+		/* Nothing below calls back into the interpreter */
+		for ( i = 0; i < k; i++ ) {
+			PyList_SET_ITEM(items, i,
+				Node_select(layout, self->root, ranks[i])->item);
+			Py_INCREF(PyList_GET_ITEM(items, i));
+		}
+	}
+
+	PyMem_Free(ranks);
+	return items;
+}
+
+/* Returns the item at quantile 'q' of the non-empty tree, by the
+ * nearest-rank method: the item of rank ceil(q * n), counting from 1.
+ * Returns a borrowed reference.
+ */
+static PyObject * BinaryTree_quantileItem(BinaryTree * self, double q) {
+	NodeLayout * layout = &self->pool.layout;
+	Py_ssize_t n, rank;
+
+	n = NODE_SUBTREE_COUNT(layout, self->root);
+	rank = (Py_ssize_t) ceil(q * n) - 1;
+	if ( rank < 0 ) rank = 0;
+	if ( rank >= n ) rank = n - 1;
+
+	return Node_select(layout, self->root, rank)->item;
+}
+
+/* Returns the item at quantile 'arg', in O(log n), or NULL on failure */
+static PyObject * BinaryTree_quantile(BinaryTree * self, PyObject * arg) {
+	PyObject * item;
+	double q;
+
+	q = PyFloat_AsDouble(arg);
+	if ( q == -1.0 && PyErr_Occurred() != NULL ) return NULL;
+
+	if ( checkQuantile(q) < 0 || checkCounts(self) < 0 ) return NULL;
+
+	releasePending();
+
+	if ( NODE_SUBTREE_COUNT(&self->pool.layout, self->root) == 0 ) {
+		PyErr_SetString(PyExc_IndexError, "quantile of an empty tree");
+		return NULL;
+	}
+
+	item = BinaryTree_quantileItem(self, q);
+	Py_INCREF(item);
+	return item;
+}
+
+/* Returns a list with the items at each quantile in the iterable 'arg',
+ * in O(log n) each. The quantiles are all converted before any is looked
+ * up, so that the conversions can't change the tree under the lookups.
+ * Returns a new list, or NULL on failure.
+ */
+static PyObject * BinaryTree_quantiles(BinaryTree * self, PyObject * arg) {
+	PyObject * seq, * items;
+	Py_ssize_t i, n;
+	double * qs;
+
+	if ( checkCounts(self) < 0 ) return NULL;
+
+	seq = PySequence_Fast(arg, "quantiles must be iterable");
+	if ( seq == NULL ) return NULL;
+
+	n = PySequence_Fast_GET_SIZE(seq);
+	qs = PyMem_New(double, n > 0 ? n : 1);
+	if ( qs == NULL ) {
+		Py_DECREF(seq);
+		return PyErr_NoMemory();
+	}
+
+	for ( i = 0; i < n; i++ ) {
+		qs[i] = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(seq, i));
+		if ( (qs[i] == -1.0 && PyErr_Occurred() != NULL) ||
+			checkQuantile(qs[i]) < 0 ) {
+			PyMem_Free(qs);
+			Py_DECREF(seq);
+			return NULL;
+		}
+	}
 
-			if ( root->rchild != NULL ) {
-				if ( child_height == root->rchild->height )
-					return root;
+	Py_DECREF(seq);
+	releasePending();
+
+	items = NULL;
+	if ( NODE_SUBTREE_COUNT(&self->pool.layout, self->root) == 0 &&
+		n > 0 ) {
+		PyErr_SetString(PyExc_IndexError, "quantile of an empty tree");
+	} else if ( (items = PyList_New(n)) != NULL ) {
+		for ( i = 0; i < n; i++ ) {
+			PyList_SET_ITEM(items, i,
+				BinaryTree_quantileItem(self, qs[i]));
+			Py_INCREF(PyList_GET_ITEM(items, i));
+		}
+	}
 
-				assert(root->rchild->height == child_height -1);
-			}
+	PyMem_Free(qs);
+	return items;
+}
 
-			/* Do we need to rebalance? */
-			if ( root->balance > -2 ) return root;
+/* Stores in 'rank' the number of items less than 'key', counting the
+ * subtrees passed on the way down from the root, in O(log n).
+ * Returns 0 on success, -1 on failure.
+ */
+static int BinaryTree_rank(BinaryTree * self, PyObject * key,
+				Py_ssize_t * rank) {
+	NodeLayout * layout = &self->pool.layout;
+	Node * current = self->root;
+	Py_ssize_t version;
+	Key encoded;
+	int cmp;
+
+	if ( BinaryTree_encode(self, key, &encoded) < 0 ) return -1;
+
+	*rank = 0;
+	version = self->version;
+	while ( current != NULL ) {
+		if ( BinaryTree_compareNode(self, current, key, &encoded,
+						&cmp) < 0 ||
+			checkVersion(self, version) < 0 ) {
+			BinaryTree_releaseKey(self, &encoded);
+			return -1;
+		}
 
-			if ( root->lchild->balance != 1 ) {
-				return rotateRight(root);
+		if ( cmp < 0 ) {
+			*rank += NODE_SUBTREE_COUNT(layout, current->lchild) +
+				!NODE_IS_DEAD(layout, current);
+			current = current->rchild;
+		} else {
+			if ( cmp == 0 ) {
+				*rank += NODE_SUBTREE_COUNT(layout,
+							current->lchild);
+				break;
 			}
 
-			root->lchild = rotateLeft(root->lchild);
-			return rotateRight(root);
+			current = current->lchild;
 		}
 	}
 
-	if ( cmp != 1 ) {
-		assert(PyErr_Occurred() != NULL);
-		return NULL; /* Unexpected result in comparison */
-	}
+	BinaryTree_releaseKey(self, &encoded);
+	return 0;
+}
+
+/* Returns the number of items in [lo, hi) as the difference of their
+ * ranks, or NULL on failure.
+ */
+static PyObject * BinaryTree_countRange(BinaryTree * self, PyObject * args) {
+	PyObject * lo, * hi;
+	Py_ssize_t lorank, hirank;
+
+	if (! PyArg_ParseTuple(args, "OO:count_range", &lo, &hi) ) return NULL;
 
-	/* Descend left */
-	if ( root->lchild )
-		child_height = root->lchild->height;
+	if ( checkCounts(self) < 0 ) return NULL;
 
-	if ( Py_EnterRecursiveCall(" in removal") != 0 )
+	releasePending();
+
+	if ( BinaryTree_rank(self, lo, &lorank) < 0 ||
+		BinaryTree_rank(self, hi, &hirank) < 0 )
+		return NULL;
+
+	return PyInt_FromSsize_t(hirank > lorank ? hirank - lorank : 0);
+}
+
+/* Counts the items falling in the buckets delimited by the sorted sequence
+ * 'arg' of b boundaries, from the rank of each boundary, in O(b log n).
+ * Returns a new list of b + 1 counts, or NULL on failure.
+ */
+static PyObject * BinaryTree_histogram(BinaryTree * self, PyObject * arg) {
+	PyObject * seq, * counts, * count;
+	Py_ssize_t i, n, rank, previous;
+
+	if ( checkCounts(self) < 0 ) return NULL;
+
+	seq = PySequence_Fast(arg, "boundaries must be iterable");
+	if ( seq == NULL ) return NULL;
+
+	releasePending();
+
+	n = PySequence_Fast_GET_SIZE(seq);
+	counts = PyList_New(n + 1);
+	if ( counts == NULL ) {
+		Py_DECREF(seq);
 		return NULL;
+	}
+
+	previous = 0;
+	for ( i = 0; i <= n; i++ ) {
+		if ( i == n ) {
+			rank = NODE_SUBTREE_COUNT(&self->pool.layout,
+							self->root);
+		} else if ( BinaryTree_rank(self,
+				PySequence_Fast_GET_ITEM(seq, i), &rank) < 0 ) {
+			goto fail;
+		}
+
+		if ( rank < previous ) {
+			PyErr_SetString(PyExc_ValueError,
+				"boundaries must be in ascending order");
+			goto fail;
+		}
+
+		count = PyInt_FromSsize_t(rank - previous);
+		if ( count == NULL ) goto fail;
 
-	root->lchild = Node_remove(root->lchild, target);
-	if ( root->lchild == NULL && PyErr_Occurred() != NULL )
+		PyList_SET_ITEM(counts, i, count);
+		previous = rank;
+	}
+
+	Py_DECREF(seq);
+	return counts;
+
+fail:
+	Py_DECREF(seq);
+	Py_DECREF(counts);
+	return NULL;
+}
+
+/* Removes the items not less than 'lo' and less than 'hi'. All comparisons
+ * are made by seeking both ends of the range before the tree is changed;
+ * in trees with keys, 'lo' and 'hi' are compared by their keys as well.
+ * Trees that keep tombstones bury the nodes in the range where they are,
+ * and treaps cut the range out with two splits and a merge, both in
+ * O(log n + k) for k items removed. Other trees unlink the nodes one by one
+ * while that costs less than rebuilding the tree without the range, in
+ * O(n), as apply_batch does.
+ * Returns the number of items removed, or NULL on failure.
+ */
+static PyObject * BinaryTree_removeRange(BinaryTree * self, PyObject * args) {
+	NodeLayout * layout = &self->pool.layout;
+	PyObject * lo, * hi, ** released = NULL;
+	NodeStack first, last, walk, nodes;
+	Node * start, * end, * middle, * left, * right, * node, * ancestor;
+	Py_ssize_t i, j, k = 0, shared, height, rank = 0, r, lcount, limit;
+	Key lokey, hikey;
+	int cmp, unlink;
+
+	if (! PyArg_ParseTuple(args, "OO:remove_range", &lo, &hi) ) return NULL;
+
+	releasePending();
+
+	/* Items are ordered by their keys, so the range must be too */
+	if ( self->keys != NULL ) {
+		if ( BinaryTree_encode(self, lo, &lokey) < 0 ) return NULL;
+		if ( BinaryTree_encode(self, hi, &hikey) < 0 ) {
+			BinaryTree_releaseKey(self, &lokey);
+			return NULL;
+		}
+
+		cmp = self->keys->compare(&lokey, &hikey);
+		BinaryTree_releaseKey(self, &lokey);
+		BinaryTree_releaseKey(self, &hikey);
+	} else if ( compareItems(lo, hi, &cmp) < 0 ) {
 		return NULL;
-	Py_LeaveRecursiveCall();
+	}
+
+	if ( cmp >= 0 || self->root == NULL ) return PyInt_FromLong(0);
+
+	NodeStack_init(&first);
+	NodeStack_init(&last);
+	NodeStack_init(&walk);
+	NodeStack_init(&nodes);
+
+	if ( BinaryTree_seek(self, lo, 0, &first) < 0 ||
+		BinaryTree_seek(self, hi, 0, &last) < 0 )
+		goto fail;
+
+	start = (first.len > 0) ? first.nodes[first.len - 1] : NULL;
+	end = (last.len > 0) ? last.nodes[last.len - 1] : NULL;
+	if ( start == end ) goto done;
+
+	/* Collect the nodes in the range, without comparisons, and make room
+	 * for everything that follows, so that nothing fails once the tree
+	 * starts changing */
+	height = BinaryTree_height(self);
+	if ( NodeStack_reserve(&walk, layout->priority != 0 ?
+						2 * height : height) < 0 ) {
+		PyErr_NoMemory();
+		goto fail;
+	}
+
+	/* Unlinking a node costs up to the height of the tree, and finding
+	 * its ancestors again, as rebalancing moves them, takes parent
+	 * pointers or subtree sizes. Splaying would make the tree deeper. */
+	unlink = layout->dead == 0 && layout->priority == 0 &&
+		(layout->parent != 0 || layout->count != 0) &&
+		self->balancer->accessed == NULL;
+	limit = (layout->dead != 0 || layout->priority != 0) ?
+			self->pool.size : (unlink ? self->pool.size / height : 0);
+
+	memcpy(walk.nodes, first.nodes, first.len * sizeof(Node *));
+	walk.len = first.len;
+	while ( walk.len > 0 && walk.nodes[walk.len - 1] != end &&
+		nodes.len < limit ) {
+		if ( NodeStack_push(&nodes, walk.nodes[walk.len - 1]) < 0 )
+			goto fail;
+
+		Node_step(&walk, 1);
+		Node_skipDead(layout, &walk, 1);
+	}
 
-	/* Fixing balance and height of the root */
-	Node_updateHeight(root);
-	NODE_UPDATE_BALANCE(root);
+	unlink = unlink && (walk.len == 0 || walk.nodes[walk.len - 1] == end);
+	if ( layout->dead == 0 && layout->priority == 0 && !unlink ) {
+		nodes.len = 0;
+		if ( Node_flatten(self->root, &nodes) < 0 ) goto fail;
+
+		for ( i = 0; nodes.nodes[i] != start; i++ );
+		for ( j = i; j < nodes.len && nodes.nodes[j] != end; j++ );
+		k = j - i;
+	} else {
+		i = 0;
+		k = nodes.len;
+	}
 
-	if ( root->lchild != NULL ) {
-		if ( child_height == root->lchild->height )
-			return root;
+	released = PyMem_New(PyObject *, k > 0 ? k : 1);
+	if ( released == NULL ) {
+		PyErr_NoMemory();
+		goto fail;
+	}
 
-		assert(root->lchild->height == child_height - 1);
+	/* The rank every node removed leaves to the next one */
+	if ( unlink && layout->parent == 0 ) {
+		rank = NODE_SUBTREE_COUNT(layout, start->lchild);
+		for ( j = 0; j < first.len - 1; j++ ) {
+			if ( first.nodes[j]->rchild == first.nodes[j + 1] )
+				rank += NODE_SUBTREE_COUNT(layout,
+						first.nodes[j]->lchild) + 1;
+		}
 	}
 
-	/* Do we need to rebalance? */
-	if ( root->balance < 2 ) return root;
+	/* No more failures from here on */
+	if ( layout->dead != 0 ) {
+		/* Burying leaves the tree as it is, so the range is walked
+		 * again, with each node's ancestors on the path */
+		memcpy(walk.nodes, first.nodes, first.len * sizeof(Node *));
+		walk.len = first.len;
+		for ( j = 0; j < k; j++ ) {
+			walk.len--;
+			released[j] = BinaryTree_bury(self, &walk,
+							nodes.nodes[j]);
+			walk.len++;
+
+			Node_step(&walk, 1);
+			Node_skipDead(layout, &walk, 1);
+		}
+
+		BinaryTree_prune(self);
+	} else if ( layout->priority != 0 ) {
+		/* In the treap right of 'start', the path to 'end' is what's
+		 * left of its path once the nodes dealt left are taken out.
+		 * Those can only be among the ancestors shared with 'start'. */
+		for ( shared = 0; shared < first.len && shared < last.len &&
+			first.nodes[shared] == last.nodes[shared]; shared++ );
+
+		for ( i = j = 0; i < last.len; i++ ) {
+			if ( i < shared && i < first.len - 1 &&
+				first.nodes[i]->rchild == first.nodes[i + 1] )
+				continue;
+
+			last.nodes[j++] = last.nodes[i];
+		}
+		last.len = j;
+
+		Node_splitBefore(layout, &first, &left, &middle);
+		right = NULL;
+		if ( end != NULL )
+			Node_splitBefore(layout, &last, &middle, &right);
 
-	if ( root->rchild->balance != -1 ) {
-		return rotateLeft(root);
+		walk.len = 0;
+		self->root = Node_merge(layout, left, right, &walk);
+
+		for ( j = 0; j < k; j++ ) {
+			released[j] = nodes.nodes[j]->item;
+			NodePool_free(&self->pool, nodes.nodes[j]);
+		}
+	} else if ( unlink ) {
+		for ( j = 0; j < k; j++ ) {
+			node = nodes.nodes[j];
+			walk.len = 0;
+
+			if ( layout->parent != 0 ) {
+				for ( ancestor = NODE_PARENT(layout, node);
+					ancestor != NULL;
+					ancestor = NODE_PARENT(layout, ancestor) )
+					walk.len++;
+
+				r = walk.len;
+				for ( ancestor = NODE_PARENT(layout, node);
+					ancestor != NULL;
+					ancestor = NODE_PARENT(layout, ancestor) )
+					walk.nodes[--r] = ancestor;
+			} else {
+				r = rank;
+				for ( ancestor = self->root; ancestor != node; ) {
+					walk.nodes[walk.len++] = ancestor;
+					lcount = NODE_SUBTREE_COUNT(layout,
+							ancestor->lchild);
+					if ( r < lcount ) {
+						ancestor = ancestor->lchild;
+					} else {
+						r -= lcount + 1;
+						ancestor = ancestor->rchild;
+					}
+				}
+			}
+
+			released[j] = BinaryTree_unlinkNode(self, &walk, node);
+		}
+	} else {
+		self->root = NULL;
+		for ( j = 0; j < k; j++ ) {
+			released[j] = nodes.nodes[i + j]->item;
+			NodePool_free(&self->pool, nodes.nodes[i + j]);
+		}
+
+		memmove(nodes.nodes + i, nodes.nodes + i + k,
+			(nodes.len - i - k) * sizeof(Node *));
+		self->root = Node_buildBalanced(layout, nodes.nodes,
+						nodes.len - k);
+		NODE_SET_PARENT(layout, self->root, NULL);
+		self->peak = nodes.len - k;
 	}
 
-	root->rchild = rotateRight(root->rchild);
-	return rotateLeft(root);
+	self->epoch++;
+	self->version++;
+
+	/* Only release removed items once the tree is consistent again, as
+	 * that may run arbitrary code. Buried nodes may have kept theirs. */
+	for ( j = 0; j < k; j++ )
+		Py_XDECREF(released[j]);
+
+done:
+	PyMem_Free(released);
+	NodeStack_free(&first);
+	NodeStack_free(&last);
+	NodeStack_free(&walk);
+	NodeStack_free(&nodes);
+
+	return PyInt_FromSsize_t(k);
+
+fail:
+	PyMem_Free(released);
+	NodeStack_free(&first);
+	NodeStack_free(&last);
+	NodeStack_free(&walk);
+	NodeStack_free(&nodes);
+
+	return NULL;
 }
 
-/* Inserts 'new' into a binary tree.
- * Returns 1 on success, 0 on error. */
-static PyObject * BinaryTree_insert(BinaryTree * self, PyObject * new) {
-	Node * newnode;
+/* Returns a page of up to 'limit' items greater than 'after', or from the
+ * first item, with a single descent to find where the page starts.
+ * Returns a tuple of the list of items and the key to pass as 'after' for
+ * the next page, which is None when no more items follow, or NULL on
+ * failure.
+ */
+static PyObject * BinaryTree_page(BinaryTree * self, PyObject * args,
+					PyObject * kwds) {
+	static char * kwlist[] = {"limit", "after", NULL};
+	PyObject * after = NULL, * items, * next = Py_None, * page;
+	Py_ssize_t limit;
+	NodeStack path;
+
+	if (! PyArg_ParseTupleAndKeywords(args, kwds, "n|O:page", kwlist,
+						&limit, &after) )
+		return NULL;
 
-	/* Create a new container */
-	newnode = Node_new();
-	if ( newnode == NULL ) return NULL;
+	if ( limit <= 0 ) {
+		PyErr_SetString(PyExc_ValueError, "limit must be positive");
+		return NULL;
+	}
 
-	Py_INCREF(new);
-	newnode->item = new;
+	/* None starts from the first item, as its default */
+	if ( after == Py_None ) after = NULL;
 
-	self->root = Node_insert(self->root, newnode);
-	if ( self->root == NULL ) {
-		Py_DECREF(newnode);
+	releasePending();
+
+	NodeStack_init(&path);
+	if ( BinaryTree_seek(self, after, 1, &path) < 0 ) {
+		NodeStack_free(&path);
 		return NULL;
 	}
 
-	Py_RETURN_NONE;
+	items = BinaryTree_collect(self, &path, 1, limit);
+	if ( items == NULL ) {
+		NodeStack_free(&path);
+		return NULL;
+	}
+
+	if ( path.len > 0 )
+		next = PyList_GET_ITEM(items, PyList_GET_SIZE(items) - 1);
+
+	NodeStack_free(&path);
+
+	page = PyTuple_Pack(2, items, next);
+	Py_DECREF(items);
+
+	return page;
 }
 
-static PyObject * BinaryTree_remove(BinaryTree * self, PyObject * target) {
-	self->root = Node_remove(self->root, target);
-	if ( self->root == NULL && PyErr_Occurred() != NULL )
+/* Creates a cursor of 'type', either CursorType or IteratorType, over
+ * 'tree', positioned as by Cursor_seek.
+ * Returns NULL on failure.
+ */
+static PyObject * Cursor_new(BinaryTree * tree, PyTypeObject * type,
+				PyObject * key) {
+	Cursor * cursor;
+
+	cursor = PyObject_GC_New(Cursor, type);
+	if ( cursor == NULL ) return NULL;
+
+	Py_INCREF(tree);
+	cursor->tree = tree;
+	cursor->version = tree->version;
+	cursor->side = 1;
+	NodeStack_init(&cursor->path);
+	PyObject_GC_Track((PyObject *) cursor);
+
+	if ( Cursor_seek(cursor, key) < 0 ) {
+		Py_DECREF(cursor);
 		return NULL;
+	}
 
-	Py_RETURN_NONE;
+	return (PyObject *) cursor;
 }
 
-/* Finds 'target' in the binary tree.
- * Returns the node containing 'target' as a new reference if it is in
- * the tree, None if it is not, or NULL upon failure.
+static void Cursor_dealloc(Cursor * self) {
+	PyObject_GC_UnTrack(self);
+	Cursor_clear(self);
+	NodeStack_free(&self->path);
+
+	Py_TYPE((PyObject *) self)->tp_free((PyObject *) self);
+
+	return;
+}
+
+static int Cursor_traverse(Cursor * self, visitproc visit, void * arg) {
+	Py_VISIT((PyObject *) self->tree);
+
+	return 0;
+}
+
+static int Cursor_clear(Cursor * self) {
+	Py_CLEAR(self->tree);
+
+	return 0;
+}
+
+/* Fills 'path' with the way down from the root of 'tree' to the first node
+ * whose item is greater than 'key', or not less than it if 'strict' isn't
+ * set, or to the first node if 'key' is NULL. 'path' is left empty if there
+ * is no such node. Room is made in 'path' for the whole height of the tree,
+ * so that it can be moved with Node_step without allocating. Tombstones
+ * are stepped past.
+ * Returns 0 on success, -1 on failure.
  */
-static PyObject * BinaryTree_locate(BinaryTree * self, PyObject * target) {
-	Node * current = self->root;
+static int BinaryTree_seek(BinaryTree * self, PyObject * key, int strict,
+				NodeStack * path) {
+	Node * current;
+	Py_ssize_t bound = 0, version;
+	Key encoded;
+	int cmp;
+
+	path->len = 0;
+	current = self->root;
+	if ( current == NULL ) return 0;
+
+	if ( NodeStack_reserve(path, BinaryTree_height(self)) < 0 ) {
+		PyErr_NoMemory();
+		return -1;
+	}
 
-	while ( current ) {
-		switch ( PyObject_Compare(current->item, target) ) {
-			case 0:
-				Py_INCREF((PyObject *) current);
-				return (PyObject *) current;
-			case 1:
-				/* Descend left */
-				current = current->lchild;
-				break;
-			case -1:
-				/* Descend right */
-				current = current->rchild;
-				break;
-			default:
-				return NULL;
+	if ( key == NULL ) {
+		Node_descend(path, current, 1);
+		Node_skipDead(&self->pool.layout, path, 1);
+		return 0;
+	}
+
+	if ( BinaryTree_encode(self, key, &encoded) < 0 ) return -1;
+
+	/* Encoding may have run code that changed the tree */
+	current = self->root;
+	version = self->version;
+	while ( current != NULL ) {
+		if ( BinaryTree_compareNode(self, current, key, &encoded,
+						&cmp) < 0 ||
+			checkVersion(self, version) < 0 ) {
+			BinaryTree_releaseKey(self, &encoded);
+			path->len = 0;
+			return -1;
 		}
+
+		path->nodes[path->len++] = current;
+
+		/* The last node past 'key' on the way down is the first such
+		 * node in the tree */
+		if ( cmp > 0 || (cmp == 0 && !strict) ) bound = path->len;
+		if ( cmp == 0 && !strict ) break;
+
+		current = (cmp > 0) ? current->lchild : current->rchild;
 	}
 
-	Py_RETURN_NONE;
+	BinaryTree_releaseKey(self, &encoded);
+	path->len = bound;
+	Node_skipDead(&self->pool.layout, path, 1);
+	return 0;
 }
 
-/* Traverses the subtree with root at 'root' in-order applying
- * 'func' to every item.
- * Returns 1 on success, -1 on error.
+/* Positions the cursor at the first item not less than 'key', or at the
+ * first item if 'key' is NULL.
+ * Returns 0 on success, -1 on failure, leaving the cursor past the end.
  */
-static int Node_inOrder(Node * root, PyObject * func) {
-	PyObject * res;
+static int Cursor_seek(Cursor * self, PyObject * key) {
+	BinaryTree * tree = self->tree;
+	int status;
 
-	if ( root == NULL ) return 1;
+	self->side = 1;
+	status = BinaryTree_seek(tree, key, 0, &self->path);
+	self->version = tree->version;
 
-	/* Traverse left subtree */
-	if ( Py_EnterRecursiveCall(" in in-order traversal") != 0 )
-		return -1;
+	if ( status < 0 ) return -1;
 
-	if ( Node_inOrder(root->lchild, func) == -1 ) return -1;
-	Py_LeaveRecursiveCall();
+	/* With parent pointers, only the current node is kept */
+	if ( tree->pool.layout.parent != 0 && self->path.len > 0 ) {
+		self->path.nodes[0] = self->path.nodes[self->path.len - 1];
+		self->path.len = 1;
+	}
 
-	/* Process this node */
-	res = PyObject_CallFunctionObjArgs(func, root->item, NULL);
-	if ( res == NULL ) return -1;
+	return 0;
+}
 
-	/* The new reference returned by the call won't be used. */
-	Py_DECREF(res);
+/* Moves the cursor to the next item if 'forward' is set, or else to the
+ * previous one, past tombstones. A cursor off one end of the tree moves
+ * back to the nearest item, and stays put when moved further off. The tree
+ * must not have changed since the cursor was positioned.
+ */
+static void Cursor_step(Cursor * self, int forward) {
+	NodeLayout * layout = &self->tree->pool.layout;
+	Node * node = NULL;
+
+	if ( layout->parent != 0 ) {
+		if ( self->path.len > 0 ) {
+			node = Node_neighbour(layout, self->path.nodes[0],
+						forward);
+		} else if ( self->side == (forward ? -1 : 1) ) {
+			node = self->tree->root;
+			while ( node != NULL &&
+				(forward ? node->lchild : node->rchild) != NULL )
+				node = forward ? node->lchild : node->rchild;
+		}
 
-	/* Traverse right subtree */
-	if ( Py_EnterRecursiveCall(" in in-order traversal") != 0 )
-		return -1;
+		while ( node != NULL && NODE_IS_DEAD(layout, node) )
+			node = Node_neighbour(layout, node, forward);
 
-	if ( Node_inOrder(root->rchild, func) == -1 ) return -1;
-	Py_LeaveRecursiveCall();
+		self->path.nodes[0] = node;
+		self->path.len = (node != NULL);
+	} else if ( self->path.len > 0 ) {
+		Node_step(&self->path, forward);
+	} else if ( self->side == (forward ? -1 : 1) ) {
+		Node_descend(&self->path, self->tree->root, forward);
+	}
 
-	return 1;
+	if ( layout->parent == 0 ) Node_skipDead(layout, &self->path, forward);
+	if ( self->path.len == 0 ) self->side = forward ? 1 : -1;
+
+	return;
 }
 
-/* Traverses the subtree with root at 'root' in pre-order applying
- * 'func' to every item.
- * Returns 1 on success, -1 on error.
+/* Moves the cursor as Cursor_step does.
+ * Returns True if the cursor is at an item afterwards, False otherwise, or
+ * NULL on failure.
  */
-static int Node_preOrder(Node * root, PyObject * func) {
-	PyObject * res;
+static PyObject * Cursor_move(Cursor * self, int forward) {
+	if ( checkVersion(self->tree, self->version) < 0 ) return NULL;
 
-	if ( root == NULL ) return 1;
+	Cursor_step(self, forward);
 
-	/* Process this node */
-	res = PyObject_CallFunctionObjArgs(func, root->item, NULL);
-	if ( res == NULL ) return -1;
+	return PyBool_FromLong(self->path.len > 0);
+}
 
-	Py_DECREF(res);
+/* Returns the item at the cursor as a new reference, and moves to the next
+ * one, or returns NULL at the end of the tree or on failure.
+ */
+static PyObject * Cursor_iternext(Cursor * self) {
+	PyObject * item;
 
-	/* Traverse left subtree */
-	if ( Py_EnterRecursiveCall(" in pre-order traversal") != 0 )
-		return -1;
+	if ( checkVersion(self->tree, self->version) < 0 ) return NULL;
+	if ( self->path.len == 0 ) return NULL;
 
-	if ( Node_preOrder(root->lchild, func) == -1 ) return -1;
-	Py_LeaveRecursiveCall();
+	item = self->path.nodes[self->path.len - 1]->item;
+	Py_INCREF(item);
+	Cursor_step(self, 1);
 
-	/* Traverse right subtree */
-	if ( Py_EnterRecursiveCall(" in pre-order traversal") != 0 )
-		return -1;
+	return item;
+}
 
-	if ( Node_preOrder(root->rchild, func) == -1 ) return -1;
-	Py_LeaveRecursiveCall();
+static PyObject * Cursor_next(Cursor * self) {
+	return Cursor_move(self, 1);
+}
 
-	return 1;
+static PyObject * Cursor_prev(Cursor * self) {
+	return Cursor_move(self, 0);
 }
 
-/* Traverses the subtree with root at 'root' in post-order
- * applying 'func' to every item.
- * Returns 1 on success, -1 on error.
+/* Returns the item at the cursor, or NULL (with IndexError set) if the
+ * cursor is off the items.
  */
-static int Node_postOrder(Node * root, PyObject * func) {
-	PyObject * res;
+static PyObject * Cursor_item(Cursor * self) {
+	PyObject * item;
 
-	if ( root == NULL ) return 1;
+	if ( checkVersion(self->tree, self->version) < 0 ) return NULL;
 
-	/* Traverse left subtree */
-	if ( Py_EnterRecursiveCall(" in post-order traversal") != 0 )
-		return -1;
+	if ( self->path.len == 0 ) {
+		PyErr_SetString(PyExc_IndexError, "cursor is not at an item");
+		return NULL;
+	}
 
-	if ( Node_postOrder(root->lchild, func) == -1 ) return -1;
-	Py_LeaveRecursiveCall();
+	item = self->path.nodes[self->path.len - 1]->item;
+	Py_INCREF(item);
 
-	/* Traverse right subtree */
-	if ( Py_EnterRecursiveCall(" in post-order traversal") != 0 )
-		return -1;
+	return item;
+}
 
-	if ( Node_postOrder(root->rchild, func) == -1 ) return -1;
-	Py_LeaveRecursiveCall();
+/* Removes the item at the cursor from the tree, using the saved path, or
+ * parent pointers, instead of searching for it. The cursor then moves to
+ * the next item. Without parent pointers, that item is looked up again, as
+ * removal may have rotated it elsewhere.
+ * Returns None on success, NULL on failure.
+ */
+static PyObject * Cursor_remove(Cursor * self) {
+	NodeLayout * layout = &self->tree->pool.layout;
+	Node * rm, * next, * node;
+	PyObject * item, * key = NULL;
+	Py_ssize_t i, len = self->path.len;
+	int status = 0;
 
-	/* Process this node */
-	res = PyObject_CallFunctionObjArgs(func, root->item, NULL);
-	if ( res == NULL ) return -1;
+	if ( checkVersion(self->tree, self->version) < 0 ) return NULL;
 
-	Py_DECREF(res);
-	return 1;
-}
+	if ( len == 0 ) {
+		PyErr_SetString(PyExc_IndexError, "cursor is not at an item");
+		return NULL;
+	}
 
-/* Creates a shallow copy of the tree starting at 'root'. Returns the
- * new (copied) root as a new reference or NULL on failure.
- */
-static Node * Node_copytree(Node * root) {
-	Node * newroot;
+	releasePending();
 
-	newroot = Node_new();
-	if ( newroot == NULL ) return NULL;
+	if ( layout->dead != 0 ) return Cursor_bury(self);
 
-	memcpy((void *) newroot, (void *) root, sizeof(Node));
-	Py_INCREF(newroot->item);
+	rm = self->path.nodes[len - 1];
 
-	if ( newroot->lchild != NULL ) {
-		if ( Py_EnterRecursiveCall(" in copytree") != 0 )
-			return NULL;
+	if ( layout->parent != 0 ) {
+		next = Node_neighbour(layout, rm, 1);
 
-		newroot->lchild = Node_copytree(newroot->lchild);
-		if ( newroot->lchild == NULL ) {
-			Node_dealloc(newroot);
+		/* Rebuild the path of ancestors of 'rm' */
+		i = 0;
+		for ( node = NODE_PARENT(layout, rm); node != NULL;
+				node = NODE_PARENT(layout, node) )
+			i++;
+
+		if ( NodeStack_reserve(&self->path, i) < 0 ) {
+			PyErr_NoMemory();
 			return NULL;
 		}
-		Py_LeaveRecursiveCall();
-	}
 
-	if ( newroot->rchild != NULL ) {
-		if ( Py_EnterRecursiveCall(" in copytree") != 0 )
-			return NULL;
+		self->path.len = i;
+		for ( node = NODE_PARENT(layout, rm); node != NULL;
+				node = NODE_PARENT(layout, node) )
+			self->path.nodes[--i] = node;
+	} else {
+		/* Find the successor of 'rm' while the path is valid */
+		next = rm->rchild;
+		if ( next != NULL ) {
+			while ( next->lchild != NULL ) next = next->lchild;
+		} else {
+			for ( i = len - 1; i > 0; i-- ) {
+				if ( self->path.nodes[i - 1]->lchild ==
+							self->path.nodes[i] ) {
+					next = self->path.nodes[i - 1];
+					break;
+				}
+			}
+		}
 
-		newroot->rchild = Node_copytree(newroot->rchild);
-		if ( newroot->rchild == NULL ) {
-			Node_dealloc(newroot);
-			return NULL;
+		if ( next != NULL ) {
+			key = next->item;
+			Py_INCREF(key);
 		}
-		Py_LeaveRecursiveCall();
+
+		self->path.len--;
 	}
 
-	return newroot;
-}
+	item = BinaryTree_unlinkNode(self->tree, &self->path, rm);
+	if ( item == NULL ) {
+		self->path.nodes[len - 1] = rm;
+		self->path.len = len;
+		Py_XDECREF(key);
+		return NULL;
+	}
 
-/* Traverses the binary tree in-order, applying 'func' to every item.
- * Returns None on success, NULL on failure.
- */
-static PyObject * BinaryTree_inOrder(BinaryTree * self, PyObject * func) {
-	if ( Node_inOrder(self->root, func) == 1 ) {
-		Py_RETURN_NONE;
+	self->path.len = 0;
+	self->side = 1;
+	self->version = self->tree->version;
+
+	if ( layout->parent != 0 && next != NULL ) {
+		/* Nodes keep their items, so 'next' is still the successor */
+		self->path.nodes[0] = next;
+		self->path.len = 1;
 	}
 
-	return NULL;
+	/* May run arbitrary code, so it's done before looking up 'key' */
+	Py_DECREF(item);
+
+	if ( key != NULL ) {
+		status = Cursor_seek(self, key);
+		Py_DECREF(key);
+	}
+
+	if ( status < 0 ) return NULL;
+
+	Py_RETURN_NONE;
 }
 
-/* Traverses the binary tree in pre-order, applying 'func' to every item.
+/* Removes the item at the cursor from a tree that keeps tombstones, by
+ * burying its node where it is, and moves the cursor to the next item. That
+ * item is looked up again only if the tree was purged.
  * Returns None on success, NULL on failure.
  */
-static PyObject * BinaryTree_preOrder(BinaryTree * self, PyObject * func) {
-	if ( Node_preOrder(self->root, func) == 1 ) {
-		Py_RETURN_NONE;
+static PyObject * Cursor_bury(Cursor * self) {
+	BinaryTree * tree = self->tree;
+	NodeLayout * layout = &tree->pool.layout;
+	NodeStack ancestors;
+	Node * rm, * node;
+	PyObject * item, * key = NULL;
+	int status = 0;
+
+	rm = self->path.nodes[self->path.len - 1];
+
+	if ( layout->parent != 0 ) {
+		/* Only 'rm' is kept in the path, so its ancestors are found
+		 * through parent pointers */
+		NodeStack_init(&ancestors);
+		for ( node = NODE_PARENT(layout, rm); node != NULL;
+				node = NODE_PARENT(layout, node) ) {
+			if ( NodeStack_push(&ancestors, node) < 0 ) {
+				NodeStack_free(&ancestors);
+				return PyErr_NoMemory();
+			}
+		}
+
+		item = BinaryTree_bury(tree, &ancestors, rm);
+		NodeStack_free(&ancestors);
+	} else {
+		self->path.len--;
+		item = BinaryTree_bury(tree, &self->path, rm);
+		self->path.len++;
 	}
 
-	return NULL;
+	self->version = tree->version;
+	Cursor_step(self, 1);
+	if ( self->path.len > 0 ) {
+		key = self->path.nodes[self->path.len - 1]->item;
+		Py_INCREF(key);
+	}
+
+	BinaryTree_prune(tree);
+
+	/* May run arbitrary code, so it's done before looking up 'key' */
+	Py_XDECREF(item);
+
+	if ( tree->dead == 0 ) {
+		self->path.len = 0;
+		self->side = 1;
+		self->version = tree->version;
+		if ( key != NULL ) status = Cursor_seek(self, key);
+	}
+
+	Py_XDECREF(key);
+	if ( status < 0 ) return NULL;
+
+	Py_RETURN_NONE;
 }
 
-/* Traverses the binary tree in post-order, applying 'func' to every item.
+/* Enables or disables deferred freeing of dropped trees.
  * Returns None on success, NULL on failure.
  */
-static PyObject * BinaryTree_postOrder(BinaryTree * self, PyObject * func) {
-	if ( Node_postOrder(self->root, func) == 1) {
-		Py_RETURN_NONE;
+static PyObject * binarytree_setDeferredFree(PyObject * self, PyObject * arg) {
+	Py_ssize_t chunk;
+
+	chunk = PyNumber_AsSsize_t(arg, PyExc_OverflowError);
+	if ( chunk == -1 && PyErr_Occurred() != NULL ) return NULL;
+
+	if ( chunk < 0 ) {
+		PyErr_SetString(PyExc_ValueError,
+			"chunk size must not be negative");
+		return NULL;
 	}
 
-	return NULL;
+	release_chunk = chunk;
+	Py_RETURN_NONE;
 }
 
-/* Copies the contents of a Subtree into a BinaryTree.
- * Returns a reference to the new BinaryTree or NULL upon
- * failure.
+/* Enables or disables huge pages for arenas allocated from now on.
+ * Returns whether they will be used, which they can't be where the platform
+ * doesn't support them, or NULL on failure.
  */
-static PyObject * Subtree_maketree(Subtree * self) {
-	BinaryTree * new;
+static PyObject * binarytree_setHugePages(PyObject * self, PyObject * arg) {
+	int enabled;
 
-	new = PyObject_GC_New(BinaryTree, &BinaryTreeType);
-	if ( new == NULL ) return NULL;
+	enabled = PyObject_IsTrue(arg);
+	if ( enabled < 0 ) return NULL;
 
-	if ( self->root )
-		new->root = Node_copytree(self->root);
+	huge_pages = enabled;
 
-	return (PyObject *) new;
+#ifdef USE_HUGE_PAGES
+	return PyBool_FromLong(enabled);
+#else
+	Py_RETURN_FALSE;
+#endif
+}
+
+/* Frees up to 'limit' queued nodes, or all of them by default.
+ * Returns True if nodes are still queued, False otherwise.
+ */
+static PyObject * binarytree_freePending(PyObject * self, PyObject * args) {
+	Py_ssize_t limit = -1;
+
+	if (! PyArg_ParseTuple(args, "|n:free_pending", &limit) )
+		return NULL;
+
+	ReleaseQueue_release(&pending_release, limit);
+	return PyBool_FromLong(pending_release.head != NULL);
 }
 
+static PyMethodDef binarytree_methods[] = {
+	{"set_deferred_free", (PyCFunction) binarytree_setDeferredFree, METH_O,
+	"set_deferred_free(chunk) -> free dropped trees incrementally, at most\n"
+	"'chunk' nodes per later tree operation. 0 frees them right away."
+	},
+	{"free_pending", (PyCFunction) binarytree_freePending, METH_VARARGS,
+	"free_pending([limit]) -> free up to 'limit' nodes of dropped trees\n"
+	"(all by default). Returns whether any are still queued."
+	},
+	{"set_huge_pages", (PyCFunction) binarytree_setHugePages, METH_O,
+	"set_huge_pages(enabled) -> whether to back large trees with huge\n"
+	"pages, where the platform supports them. Enabled by default.\n"
+	"Returns whether huge pages will be used."
+	},
+	{NULL}, /* Sentinel */
+};
+
 #ifndef PyMODINIT_FUNC
 #define PyMODINIT_FUNC void
 #endif
@@ -869,7 +5861,7 @@ initbinarytree(void) {
 	PyObject * module;
 
 	/* NodeType setup */
-	NodeType.tp_basicsize = sizeof(Node);
+	NodeType.tp_basicsize = sizeof(NodeObject);
 	NodeType.tp_name = "binarytree.Node";
 	NodeType.tp_doc = "A data container.";
 	NodeType.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC;
@@ -882,16 +5874,39 @@ initbinarytree(void) {
 
 	if ( PyType_Ready(&NodeType) < 0 ) return;
 
+	PyDateTime_IMPORT;
+	if ( PyDateTimeAPI == NULL ) return;
+
+	random_state = (unsigned PY_LONG_LONG) time(NULL) ^
+			(unsigned PY_LONG_LONG) (Py_uintptr_t) &random_state;
+
 	/* BinaryTreeType setup */
 	PyDoc_STRVAR(binary_tree_doc,
 	"The main binary tree class.\n\
 	BinaryTree() -> empty binary tree.\n\
-	BinaryTree(iterable) -> Tree containing iterable's items.");
+	BinaryTree(iterable) -> Tree containing iterable's items.\n\
+	With parents=False, nodes don't keep a pointer to their parent, which\n\
+	saves memory, but makes cursors keep the path from the root instead.\n\
+	With sizes=False, nodes don't keep the size of their subtree, which\n\
+	saves memory, but disables sampling and rank queries.\n\
+	balance='wavl' makes the tree a WAVL tree instead of an AVL tree, which\n\
+	rotates less on removal, but may be deeper. balance='splay' and\n\
+	balance='semisplay' make lookups move the items they find towards the\n\
+	root, which suits workloads where a few items get most lookups.\n\
+	balance='treap' makes the tree a treap, from which ranges of items can\n\
+	be removed in O(log n) plus the items removed.\n\
+	balance='scapegoat' keeps no balancing fields in the nodes, and rebuilds\n\
+	subtrees that grow too deep instead.\n\
+	tombstones=f, for a fraction f between 0 and 1, makes remove() only mark\n\
+	nodes, which reads skip, until more than f of them are marked and the\n\
+	tree is rebuilt without them.\n\
+	key_type='memcmp', 'bytes16', 'bytes32', 'datetime' or 'int64' encodes\n\
+	items into keys kept in the nodes, which lookups compare natively.");
 
 	BinaryTree_sequence.sq_contains = (objobjproc) BinaryTree_contains;
 
 	BinaryTreeType.tp_init = (initproc) BinaryTree_init;
-	BinaryTreeType.tp_new = (newfunc) PyType_GenericNew;
+	BinaryTreeType.tp_new = (newfunc) BinaryTree_new;
 	BinaryTreeType.tp_basicsize = sizeof(BinaryTree);
 	BinaryTreeType.tp_name = "binarytree.BinaryTree";
 	BinaryTreeType.tp_doc = binary_tree_doc;
@@ -900,8 +5915,9 @@ initbinarytree(void) {
 				Py_TPFLAGS_HAVE_GC;
 	BinaryTreeType.tp_dealloc = (destructor) BinaryTree_dealloc;
 	BinaryTreeType.tp_methods = BinaryTree_methods;
-	BinaryTreeType.tp_members = BinaryTree_members;
+	BinaryTreeType.tp_getset = BinaryTree_getsetters;
 	BinaryTreeType.tp_as_sequence = &BinaryTree_sequence;
+	BinaryTreeType.tp_iter = (getiterfunc) BinaryTree_iter;
 	BinaryTreeType.tp_traverse = (traverseproc) BinaryTree_traverse;
 	BinaryTreeType.tp_clear = (inquiry) BinaryTree_clear;
 	BinaryTreeType.tp_free = PyObject_GC_Del;
@@ -911,6 +5927,8 @@ initbinarytree(void) {
 	/* Subtree setup. We don't inherit from BinaryTree because
 	 * Subtrees have different methods.
 	 */
+	Subtree_sequence.sq_contains = (objobjproc) Subtree_contains;
+
 	SubtreeType.tp_basicsize = sizeof(Subtree);
 	SubtreeType.tp_name = "binarytree.Subtree";
 	SubtreeType.tp_doc = "A read-only subtree of a BinaryTree.";
@@ -918,16 +5936,46 @@ initbinarytree(void) {
 	SubtreeType.tp_flags = Py_TPFLAGS_DEFAULT |
 				Py_TPFLAGS_BASETYPE |
 				Py_TPFLAGS_HAVE_GC;
-	SubtreeType.tp_dealloc = (destructor) BinaryTree_dealloc;
-	SubtreeType.tp_members = BinaryTree_members;
-	SubtreeType.tp_as_sequence = &BinaryTree_sequence;
-	SubtreeType.tp_traverse = (traverseproc) BinaryTree_traverse;
-	SubtreeType.tp_clear = (inquiry) BinaryTree_clear;
+	SubtreeType.tp_dealloc = (destructor) Subtree_dealloc;
+	SubtreeType.tp_getset = Subtree_getsetters;
+	SubtreeType.tp_as_sequence = &Subtree_sequence;
+	SubtreeType.tp_traverse = (traverseproc) Subtree_traverse;
+	SubtreeType.tp_clear = (inquiry) Subtree_clear;
 	SubtreeType.tp_free = PyObject_GC_Del;
 
 	if ( PyType_Ready(&SubtreeType) < 0 ) return;
 
-	module = Py_InitModule3("binarytree", NULL,
+	/* CursorType setup */
+	CursorType.tp_basicsize = sizeof(Cursor);
+	CursorType.tp_name = "binarytree.Cursor";
+	CursorType.tp_doc = "A position among the items of a BinaryTree.";
+	CursorType.tp_methods = Cursor_methods;
+	CursorType.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC;
+	CursorType.tp_dealloc = (destructor) Cursor_dealloc;
+	CursorType.tp_getset = Cursor_getsetters;
+	CursorType.tp_traverse = (traverseproc) Cursor_traverse;
+	CursorType.tp_clear = (inquiry) Cursor_clear;
+	CursorType.tp_free = PyObject_GC_Del;
+
+	if ( PyType_Ready(&CursorType) < 0 ) return;
+
+	/* IteratorType setup. Iterators are cursors that only move forward,
+	 * through the iterator protocol.
+	 */
+	IteratorType.tp_basicsize = sizeof(Cursor);
+	IteratorType.tp_name = "binarytree.Iterator";
+	IteratorType.tp_doc = "An in-order iterator over a BinaryTree.";
+	IteratorType.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC;
+	IteratorType.tp_dealloc = (destructor) Cursor_dealloc;
+	IteratorType.tp_traverse = (traverseproc) Cursor_traverse;
+	IteratorType.tp_clear = (inquiry) Cursor_clear;
+	IteratorType.tp_iter = PyObject_SelfIter;
+	IteratorType.tp_iternext = (iternextfunc) Cursor_iternext;
+	IteratorType.tp_free = PyObject_GC_Del;
+
+	if ( PyType_Ready(&IteratorType) < 0 ) return;
+
+	module = Py_InitModule3("binarytree", binarytree_methods,
 				"A self-balancing binary search tree.");
 
 	Py_INCREF(&BinaryTreeType);
@@ -939,5 +5987,8 @@ initbinarytree(void) {
 	Py_INCREF(&SubtreeType);
 	PyModule_AddObject(module, "Subtree", (PyObject *) &SubtreeType);
 
+	Py_INCREF(&CursorType);
+	PyModule_AddObject(module, "Cursor", (PyObject *) &CursorType);
+
 	return;
 }
@@ -1,4 +1,9 @@
+import datetime
+import math
+import random
+import sys
 import unittest
+import weakref
 import binarytree
 from collections import deque
 
@@ -23,6 +28,66 @@ def transversal(tree):
 				queue.append(sub)
 	return items
 
+# Returns the in-order list of a tree's items.
+def in_order(tree):
+	items = []
+	tree.in_order(items.append)
+	return items
+
+# Checks the AVL invariant on every node of a tree. Returns its height.
+def check_balanced(test, tree):
+	if tree.root is None:
+		return 0
+
+	lheight = check_balanced(test, tree.root.left_child)
+	rheight = check_balanced(test, tree.root.right_child)
+	test.assertTrue(abs(lheight - rheight) <= 1)
+
+	return 1 + max(lheight, rheight)
+
+def height(tree):
+	if tree.root is None:
+		return 0
+
+	return 1 + max(height(tree.root.left_child),
+			height(tree.root.right_child))
+
+# An item whose comparisons always fail.
+class Incomparable(object):
+	def __cmp__(self, other):
+		raise ValueError("incomparable")
+
+# An item that compares like 'value', except against 'fragile', where the
+# comparison fails.
+class Fragile(object):
+	def __init__(self, value, fragile):
+		self.value = value
+		self.fragile = fragile
+
+	def __cmp__(self, other):
+		if other == self.fragile:
+			raise ValueError("fragile")
+		return cmp(self.value, other)
+
+# A weak-referenceable, comparable item.
+class Item(object):
+	def __init__(self, value):
+		self.value = value
+
+	def __cmp__(self, other):
+		return cmp(self.value, other.value)
+
+# A timezone at a fixed offset from UTC, in minutes.
+class FixedOffset(datetime.tzinfo):
+	def __init__(self, minutes):
+		self.offset = datetime.timedelta(minutes=minutes)
+
+	def utcoffset(self, dt):
+		return self.offset
+
+	def dst(self, dt):
+		return None
+
 class BinaryTreeTest(unittest.TestCase):
 	def setUp(self):
 		''' Build the test tree. '''
@@ -150,6 +215,885 @@ class BinaryTreeTest(unittest.TestCase):
 			deque((73, 62, 80, 44, 71, 78, 83, 57)),
 			"Fifth set of removals failed.")
 
+	def testApplyBatch(self):
+		''' Tests applying batches of insertions and removals '''
+
+		expected = set(self.items)
+		self.tree.apply_batch([99, 3, 56, 3, 42, 100],
+					[0, 85, 42, 7, 73])
+		expected.update((99, 3, 56, 42, 100))
+		expected.difference_update((0, 85, 42, 7, 73))
+
+		self.assertEquals(in_order(self.tree), sorted(expected))
+		check_balanced(self, self.tree)
+
+		self.tree.apply_batch(range(1000), [])
+		self.assertEquals(in_order(self.tree),
+			sorted(expected.union(range(1000))))
+		check_balanced(self, self.tree)
+
+		empty = binarytree.BinaryTree()
+		empty.apply_batch((), ())
+		self.assertTrue(empty.root is None)
+
+		# Small batches go into large trees in place
+		for options in ({}, {'parents': False, 'key_type': 'int64'},
+				{'tombstones': 0.5}):
+			large = binarytree.BinaryTree(xrange(0, 4000, 2),
+							**options)
+			large.remove(10)
+			large.apply_batch([-1, 3, 3, 8, 9, 10, 3999, 5000],
+						[0, 3, 6, 6, 7, 3998])
+			expected = set(xrange(0, 4000, 2))
+			expected.update((-1, 9, 10, 3999, 5000))
+			expected.difference_update((0, 6, 3998))
+
+			self.assertEquals(in_order(large), sorted(expected))
+			self.assertEquals(large.count_range(-1, 5001),
+						len(expected))
+			check_balanced(self, large)
+
+	def testApplyBatchFailure(self):
+		''' Tests that a failed batch leaves the tree unchanged '''
+
+		before = in_order(self.tree)
+		shape = transversal(self.tree)
+
+		self.assertRaises(ValueError, self.tree.apply_batch,
+			[5, Incomparable(), 6], [56])
+		self.assertRaises(ValueError, self.tree.apply_batch,
+			[5], [Incomparable()])
+
+		self.assertEquals(in_order(self.tree), before)
+		self.assertEquals(transversal(self.tree), shape)
+
+		# Tombstones are only purged once the batch has gone through
+		tree = binarytree.BinaryTree(xrange(100), tombstones=0.5)
+		tree.remove(50)
+		node = tree.locate(49)
+		for inserts in ([5, Fragile(48.5, 49)],
+				range(100, 200) + [Fragile(48.5, 49)]):
+			self.assertRaises(ValueError, tree.apply_batch,
+						inserts, [])
+			self.assertEquals(node.left_child.root.item, 48)
+
+		tree.apply_batch(range(200), [])
+		self.assertRaises(RuntimeError, getattr, node, 'left_child')
+		self.assertEquals(in_order(tree), range(200))
+
+	def testFailedMutation(self):
+		''' Tests that comparisons failing midway through insertions
+		and removals leave the tree intact '''
+
+		before = in_order(self.tree)
+		shape = transversal(self.tree)
+
+		# 73 and 56 compare fine, 44 is reached deeper in the tree.
+		self.assertRaises(ValueError, self.tree.insert, Fragile(45, 44))
+		self.assertRaises(ValueError, self.tree.remove, Fragile(12, 44))
+		self.assertRaises(ValueError, self.tree.locate, Fragile(12, 44))
+
+		self.assertEquals(in_order(self.tree), before)
+		self.assertEquals(transversal(self.tree), shape)
+		check_balanced(self, self.tree)
+
+	def testRandomMutations(self):
+		''' Tests random insertions and removals against a set '''
+
+		rng = random.Random(76)
+		tree = binarytree.BinaryTree()
+		expected = set()
+
+		for i in xrange(3000):
+			item = rng.randint(0, 500)
+			if rng.random() < 0.6:
+				tree.insert(item)
+				expected.add(item)
+			else:
+				tree.remove(item)
+				expected.discard(item)
+
+		self.assertEquals(in_order(tree), sorted(expected))
+		check_balanced(self, tree)
+
+	def testDeferredFree(self):
+		''' Tests freeing dropped trees incrementally '''
+
+		items = map(Item, xrange(1000))
+		refs = map(weakref.ref, items)
+		tree = binarytree.BinaryTree(items)
+		del items
+
+		binarytree.set_deferred_free(100)
+		try:
+			del tree
+			self.assertEquals(sum(r() is None for r in refs), 0)
+
+			# Each tree operation frees the next chunk of nodes
+			self.tree.insert(1000)
+			freed = sum(r() is None for r in refs)
+			self.assertTrue(0 < freed <= 100)
+
+			self.assertTrue(binarytree.free_pending(100))
+			self.assertTrue(freed < sum(r() is None for r in refs))
+			self.assertFalse(binarytree.free_pending())
+			self.assertEquals(sum(r() is None for r in refs), 1000)
+		finally:
+			binarytree.set_deferred_free(0)
+
+		self.assertRaises(ValueError, binarytree.set_deferred_free, -1)
+
+	def testDropHeldSubtree(self):
+		''' Tests that dropping a tree spares subtrees still in use '''
+
+		tree = binarytree.BinaryTree(xrange(100000))
+		left = tree.root.left_child
+		pivot = tree.root.item
+		del tree
+
+		self.assertEquals(in_order(left), range(pivot))
+
+	def testClear(self):
+		''' Tests clearing a tree and the handles that outlive it '''
+
+		items = map(Item, xrange(1000))
+		refs = map(weakref.ref, items)
+		tree = binarytree.BinaryTree(items)
+		node = tree.root
+		subtree = node.left_child
+		del items
+
+		tree.clear()
+		self.assertEquals(tree.root, None)
+		self.assertEquals(sum(r() is None for r in refs), 999)
+		self.assertTrue(any(node.item is r() for r in refs))
+		self.assertRaises(RuntimeError, lambda: node.left_child)
+		self.assertRaises(RuntimeError, subtree.in_order, id)
+
+		tree.insert(1)
+		self.assertEquals(in_order(tree), [1])
+
+	def testReserveAndShrink(self):
+		''' Tests reserving node storage and giving it back '''
+
+		tree = binarytree.BinaryTree()
+		tree.reserve(1000)
+		self.assertTrue(tree.capacity >= 1000)
+
+		capacity = tree.capacity
+		for i in xrange(1000):
+			tree.insert(i)
+		self.assertEquals(tree.capacity, capacity)
+
+		node = tree.root
+		for i in xrange(0, 1000, 3):
+			tree.remove(i)
+
+		tree.shrink()
+		self.assertEquals(tree.capacity, 666)
+		self.assertEquals(in_order(tree), [i for i in xrange(1000) if i % 3])
+		check_balanced(self, tree)
+		self.assertRaises(RuntimeError, lambda: node.left_child)
+
+		tree.clear()
+		tree.shrink()
+		self.assertEquals(tree.capacity, 0)
+		self.assertRaises(ValueError, tree.reserve, -1)
+
+	def testHugePages(self):
+		''' Tests trees large enough to be backed by huge pages '''
+
+		# Arenas grown past half a huge page fill a whole one
+		capacity = {}
+		for enabled in (True, False):
+			mapped = binarytree.set_huge_pages(enabled)
+			try:
+				tree = binarytree.BinaryTree(xrange(40000))
+				capacity[mapped] = tree.capacity
+			finally:
+				binarytree.set_huge_pages(True)
+
+		if True in capacity:
+			self.assertTrue(capacity[True] > capacity[False])
+
+		for enabled in (True, False):
+			binarytree.set_huge_pages(enabled)
+			try:
+				tree = binarytree.BinaryTree()
+				tree.reserve(100000)
+				self.assertTrue(tree.capacity >= 100000)
+
+				for i in xrange(100000):
+					tree.insert(i)
+				for i in xrange(0, 100000, 2):
+					tree.remove(i)
+
+				tree.shrink()
+				self.assertTrue(50000 <= tree.capacity < 100000)
+				self.assertEquals(in_order(tree),
+							range(1, 100000, 2))
+			finally:
+				binarytree.set_huge_pages(True)
+
+	def testCursor(self):
+		''' Tests moving cursors around the tree '''
+
+		tree = binarytree.BinaryTree(xrange(0, 100, 2))
+
+		cursor = tree.cursor()
+		items = [cursor.item]
+		while cursor.next():
+			items.append(cursor.item)
+		self.assertEquals(items, range(0, 100, 2))
+		self.assertRaises(IndexError, lambda: cursor.item)
+
+		self.assertTrue(cursor.prev())
+		self.assertEquals(cursor.item, 98)
+
+		cursor = tree.cursor(31)
+		self.assertEquals(cursor.item, 32)
+		self.assertTrue(cursor.prev())
+		self.assertEquals(cursor.item, 30)
+
+		cursor = tree.cursor(0)
+		self.assertFalse(cursor.prev())
+		self.assertTrue(cursor.next())
+		self.assertEquals(cursor.item, 0)
+		self.assertFalse(tree.cursor(99).next())
+
+	def testCursorRemove(self):
+		''' Tests removing items through a cursor '''
+
+		tree = binarytree.BinaryTree(xrange(1000))
+		cursor = tree.cursor(1)
+		while True:
+			cursor.remove()
+			if not cursor.next():
+				break
+
+		self.assertEquals(in_order(tree), range(0, 1000, 2))
+		check_balanced(self, tree)
+
+		cursor = tree.cursor(500)
+		tree.insert(501)
+		self.assertRaises(RuntimeError, cursor.next)
+		self.assertRaises(RuntimeError, lambda: cursor.item)
+
+	def testNodeLayouts(self):
+		''' Tests cursors over trees with and without parent pointers '''
+
+		random.seed(3)
+		for parents in (True, False):
+			tree = binarytree.BinaryTree(parents=parents)
+			expected = set()
+			for i in xrange(3000):
+				item = random.randrange(500)
+				if random.random() < 0.6:
+					tree.insert(item)
+					expected.add(item)
+				else:
+					tree.remove(item)
+					expected.discard(item)
+
+			tree.apply_batch(range(500, 600), range(0, 100))
+			expected = (expected | set(range(500, 600))) - set(range(100))
+			tree.shrink()
+			self.assertEquals(in_order(tree), sorted(expected))
+
+			pivot = tree.root.item
+			tree = tree.root.right_child.make_tree()
+			expected = [i for i in sorted(expected) if i > pivot]
+
+			cursor = tree.cursor()
+			items = [cursor.item]
+			while cursor.next():
+				items.append(cursor.item)
+			self.assertEquals(items, expected)
+
+			items = []
+			while cursor.prev():
+				items.append(cursor.item)
+			self.assertEquals(items, expected[::-1])
+
+			cursor = tree.cursor()
+			while cursor.next():
+				cursor.remove()
+			self.assertEquals(in_order(tree), expected[::2])
+			check_balanced(self, tree)
+
+		self.assertRaises(ValueError, binarytree.BinaryTree.__init__,
+					tree, parents=True)
+
+	def testModifiedDuringIteration(self):
+		''' Tests that changing a tree while walking it raises '''
+
+		tree = binarytree.BinaryTree(xrange(100))
+		self.assertEquals(list(tree), range(100))
+
+		iterator = iter(tree)
+		iterator.next()
+		tree.insert(100)
+		self.assertRaises(RuntimeError, iterator.next)
+
+		for traversal in (tree.in_order, tree.pre_order, tree.post_order):
+			self.assertRaises(RuntimeError, traversal,
+						lambda item: tree.insert(item + 1000))
+			self.assertRaises(RuntimeError, traversal, tree.remove)
+
+		self.assertRaises(RuntimeError, tree.root.left_child.in_order,
+					lambda item: tree.insert(-item - 1))
+		check_balanced(self, tree)
+
+		class Meddler(Item):
+			armed = False
+
+			def __cmp__(self, other):
+				if Meddler.armed:
+					Meddler.armed = False
+					tree.insert(Meddler(-1000))
+				return Item.__cmp__(self, other)
+
+		tree = binarytree.BinaryTree(map(Meddler, xrange(10)))
+		Meddler.armed = True
+		self.assertRaises(RuntimeError, tree.insert, Meddler(5.5))
+		self.assertEquals(list(item.value for item in tree), [-1000] + range(10))
+		check_balanced(self, tree)
+
+	def testPage(self):
+		''' Tests paginating through the tree '''
+
+		tree = binarytree.BinaryTree(xrange(0, 100, 3))
+
+		items, after = tree.page(limit=10)
+		pages = [items]
+		while after is not None:
+			items, after = tree.page(10, after)
+			pages.append(items)
+
+		self.assertEquals(sum(pages, []), range(0, 100, 3))
+		self.assertEquals(map(len, pages), [10, 10, 10, 4])
+
+		self.assertEquals(tree.page(after=50, limit=2), ([51, 54], 54))
+		self.assertEquals(tree.page(after=97, limit=5), ([99], None))
+		self.assertEquals(tree.page(after=99, limit=5), ([], None))
+		self.assertEquals(tree.page(2, None), ([0, 3], 3))
+		self.assertRaises(ValueError, tree.page, 0, 0)
+		self.assertRaises(TypeError, tree.page)
+		self.assertRaises(TypeError, tree.page, after=50)
+
+	def testExtremes(self):
+		''' Tests extracting the smallest and largest items '''
+
+		tree = binarytree.BinaryTree(xrange(0, 1000, 7))
+		self.assertEquals(tree.smallest(3), [0, 7, 14])
+		self.assertEquals(tree.largest(3), [994, 987, 980])
+		self.assertEquals(tree.smallest(1000), range(0, 1000, 7))
+		self.assertEquals(tree.largest(0), [])
+		self.assertEquals(binarytree.BinaryTree().largest(5), [])
+		self.assertRaises(ValueError, tree.smallest, -1)
+
+	def testSample(self):
+		''' Tests random sampling, and the subtree sizes it relies on '''
+
+		tree = binarytree.BinaryTree(xrange(100))
+		sample = tree.sample(10, seed=42)
+		self.assertEquals(sample, tree.sample(10, seed=42))
+		self.assertNotEquals(tree.sample(10, seed=-1),
+					tree.sample(10, seed=-2))
+		self.assertEquals(tree.sample(10, seed=42L), sample)
+		self.assertRaises(TypeError, tree.sample, 10, seed='a')
+		self.assertEquals(len(set(sample)), 10)
+		self.assertTrue(all(item in tree for item in sample))
+		self.assertEquals(len(tree.sample(300, replace=True)), 300)
+		self.assertEquals(tree.sample(0), [])
+
+		self.assertRaises(ValueError, tree.sample, 101)
+		self.assertRaises(ValueError, tree.sample, -1)
+		self.assertRaises(ValueError, binarytree.BinaryTree().sample, 1,
+					replace=True)
+		self.assertRaises(TypeError,
+			binarytree.BinaryTree(range(5), sizes=False).sample, 1)
+
+		# A full sample visits every rank once if the sizes are right
+		random.seed(0)
+		items = set(range(100))
+		for i in xrange(500):
+			item = random.randrange(200)
+			if item in items:
+				tree.remove(item)
+				items.discard(item)
+			else:
+				tree.insert(item)
+				items.add(item)
+
+			if i % 50 == 0:
+				self.assertEquals(sorted(tree.sample(len(items))),
+							sorted(items))
+
+	def testQuantiles(self):
+		''' Tests quantiles by the nearest-rank method '''
+
+		tree = binarytree.BinaryTree(xrange(1, 101))
+		self.assertEquals(tree.quantile(0), 1)
+		self.assertEquals(tree.quantile(0.5), 50)
+		self.assertEquals(tree.quantile(0.99), 99)
+		self.assertEquals(tree.quantile(1), 100)
+		self.assertEquals(tree.quantiles([0.25, 0.5, 0.75]), [25, 50, 75])
+
+		# A sliding window of the last 50 values
+		for value in xrange(101, 151):
+			tree.remove(value - 100)
+			tree.insert(value)
+		self.assertEquals(tree.quantile(0.5), 100)
+		self.assertEquals(tree.quantiles([]), [])
+
+		self.assertRaises(ValueError, tree.quantile, 1.5)
+		self.assertRaises(ValueError, tree.quantiles, [0.5, -0.1])
+		self.assertRaises(TypeError, tree.quantile, "median")
+		self.assertRaises(IndexError, binarytree.BinaryTree().quantile, 0.5)
+
+	def testCountRange(self):
+		''' Tests counting the items in a range '''
+
+		tree = binarytree.BinaryTree(xrange(0, 100, 2))
+		self.assertEquals(tree.count_range(10, 20), 5)
+		self.assertEquals(tree.count_range(11, 21), 5)
+		self.assertEquals(tree.count_range(-50, 500), 50)
+		self.assertEquals(tree.count_range(20, 10), 0)
+		self.assertEquals(tree.count_range(98, 98), 0)
+
+		random.seed(0)
+		for i in xrange(100):
+			lo, hi = random.randrange(-10, 110), random.randrange(-10, 110)
+			expected = len([x for x in xrange(0, 100, 2) if lo <= x < hi])
+			self.assertEquals(tree.count_range(lo, hi), expected)
+
+		self.assertRaises(ValueError, tree.count_range, 0, Incomparable())
+		self.assertRaises(TypeError,
+			binarytree.BinaryTree(sizes=False).count_range, 0, 1)
+
+	def testHistogram(self):
+		''' Tests counting the items in buckets '''
+
+		tree = binarytree.BinaryTree(xrange(100))
+		self.assertEquals(tree.histogram([10, 50, 90]), [10, 40, 40, 10])
+		self.assertEquals(tree.histogram([-5, 10, 10, 200]), [0, 10, 0, 90, 0])
+		self.assertEquals(tree.histogram([]), [100])
+		self.assertEquals(binarytree.BinaryTree().histogram([1, 2]), [0, 0, 0])
+
+		self.assertRaises(ValueError, tree.histogram, [50, 10])
+		self.assertRaises(TypeError, tree.histogram, 10)
+
+	def testBalancingSchemes(self):
+		''' Tests WAVL trees against the same operations as AVL trees '''
+
+		tree = binarytree.BinaryTree(xrange(100), balance='wavl')
+		self.assertEquals(tree.balance, 'wavl')
+		self.assertEquals(binarytree.BinaryTree().balance, 'avl')
+
+		# Without removals, WAVL trees are AVL trees
+		check_balanced(self, tree)
+
+		random.seed(0)
+		items = set(range(100))
+		for i in xrange(2000):
+			item = random.randrange(300)
+			if random.random() < 0.4:
+				tree.insert(item)
+				items.add(item)
+			else:
+				tree.remove(item)
+				items.discard(item)
+
+		self.assertEquals(in_order(tree), sorted(items))
+		self.assertEquals(list(tree), sorted(items))
+		self.assertEquals(sorted(tree.sample(len(items))), sorted(items))
+
+		copy = tree.root.left_child.make_tree()
+		self.assertEquals(copy.balance, 'wavl')
+		for item in in_order(copy):
+			copy.remove(item)
+		self.assertEquals(copy.root, None)
+
+		self.assertRaises(ValueError, binarytree.BinaryTree, balance='rb')
+		self.assertRaises(ValueError, tree.__init__, balance='avl')
+
+	def testSplay(self):
+		''' Tests that splay trees move the items they find to the root '''
+
+		for balance in ('splay', 'semisplay'):
+			tree = binarytree.BinaryTree(balance=balance)
+			for item in xrange(5000):
+				tree.insert(item)
+
+			# Sorted insertions leave a path, deeper than recursion
+			# could handle
+			self.assertEquals(in_order(tree), range(5000))
+			self.assertEquals(len(in_order(tree.root.left_child.make_tree())),
+						4999)
+
+			self.assertTrue(1234 in tree)
+			if balance == 'splay':
+				self.assertEquals(tree.root.item, 1234)
+
+			# Semi-splaying keeps hot items near the root
+			for i in xrange(10):
+				tree.locate(1234)
+			root = tree.root
+			self.assertTrue(1234 in (root.item,
+				root.left_child.root.item, root.right_child.root.item))
+			self.assertTrue(9999 not in tree)
+
+			random.seed(0)
+			items = set(range(5000))
+			for i in xrange(2000):
+				item = random.randrange(6000)
+				if random.random() < 0.5:
+					tree.insert(item)
+					items.add(item)
+				else:
+					tree.remove(item)
+					items.discard(item)
+
+			self.assertEquals(list(tree), sorted(items))
+			self.assertEquals(sorted(tree.sample(len(items))),
+						sorted(items))
+
+			# Lookups change the tree
+			def lookup(item):
+				return item + 1 in tree
+			self.assertRaises(RuntimeError, tree.in_order, lookup)
+
+	def testRemoveRange(self):
+		''' Tests removing ranges of items, from treaps and other trees '''
+
+		for balance, options in (('treap', {}), ('avl', {}),
+				('avl', {'parents': False}), ('scapegoat', {}),
+				('avl', {'tombstones': 0.5})):
+			tree = binarytree.BinaryTree(xrange(100), balance=balance,
+							**options)
+			self.assertEquals(tree.balance, balance)
+			node = tree.locate(50)
+
+			self.assertEquals(tree.remove_range(40, 60), 20)
+			self.assertEquals(list(tree), range(40) + range(60, 100))
+			self.assertRaises(RuntimeError, getattr, node, 'left_child')
+
+			self.assertEquals(tree.remove_range(40, 60), 0)
+			self.assertEquals(tree.remove_range(90, 10), 0)
+			self.assertEquals(tree.remove_range(95, 1000), 5)
+			self.assertEquals(tree.remove_range(-5, 5), 5)
+			self.assertEquals(list(tree), range(5, 40) + range(60, 95))
+			self.assertRaises(ValueError, tree.remove_range, 0,
+						Incomparable())
+
+			random.seed(0)
+			items = set(tree)
+			for i in xrange(500):
+				item = random.randrange(200)
+				if random.random() < 0.9:
+					tree.insert(item)
+					items.add(item)
+				else:
+					tree.remove_range(item, item + 10)
+					items.difference_update(range(item, item + 10))
+
+			self.assertEquals(list(tree), sorted(items))
+			self.assertEquals(sorted(tree.sample(len(items))),
+						sorted(items))
+			self.assertEquals(tree.remove_range(-1, 1000), len(items))
+			self.assertEquals(tree.root, None)
+
+		# Trees with keys compare the ends of the range by their keys
+		tree = binarytree.BinaryTree(xrange(100), key_type='int64')
+		self.assertEquals(tree.remove_range(10, 20L), 10)
+		self.assertRaises(TypeError, tree.remove_range, 0, 'a')
+		self.assertEquals(tree.count_range(0, 100), 90)
+
+	def testScapegoat(self):
+		''' Tests that scapegoat trees stay shallow without balance fields '''
+
+		for options in ({}, {'sizes': False, 'parents': False}):
+			tree = binarytree.BinaryTree(xrange(1000),
+					balance='scapegoat', **options)
+			self.assertEquals(tree.balance, 'scapegoat')
+			self.assertEquals(in_order(tree), range(1000))
+
+			# Sorted insertions set off rebuilds, that keep the tree
+			# within log(n) in base 3/2 of the root
+			self.assertTrue(height(tree) <= math.log(1000, 1.5) + 1)
+
+			for item in xrange(100, 1000):
+				tree.remove(item)
+			self.assertEquals(list(tree), range(100))
+			self.assertTrue(height(tree) <= math.log(100, 1.5) + 1)
+
+			random.seed(0)
+			items = set(tree)
+			for i in xrange(2000):
+				item = random.randrange(300)
+				if random.random() < 0.6:
+					tree.insert(item)
+					items.add(item)
+				else:
+					tree.remove(item)
+					items.discard(item)
+
+			self.assertEquals(list(tree), sorted(items))
+			self.assertTrue(height(tree) <= math.log(300, 1.5) + 2)
+
+			cursor = tree.cursor(150)
+			self.assertEquals(cursor.item, min(i for i in items if i >= 150))
+
+	def testTombstones(self):
+		''' Tests removals that leave tombstones until the tree is purged '''
+
+		items = [Item(i) for i in xrange(100)]
+		refs = map(weakref.ref, items)
+		tree = binarytree.BinaryTree(items, tombstones=0.5)
+		del items
+
+		for i in xrange(0, 40, 2):
+			tree.remove(Item(i))
+
+		# Tombstones keep their items to route lookups
+		self.assertFalse(Item(0) in tree)
+		self.assertTrue(Item(1) in tree)
+		self.assertTrue(refs[0]() is not None)
+
+		# Inserting an equal item brings a tombstone back
+		tree.insert(Item(2))
+		self.assertTrue(Item(2) in tree)
+
+		# Reads skip tombstones, without purging them or changing the tree
+		node = tree.locate(Item(41))
+		expected = [i for i in xrange(100) if i >= 40 or i % 2 or i == 2]
+		self.assertEquals(list(item.value for item in tree), expected)
+		self.assertEquals([item.value for item in tree.smallest(3)],
+					[1, 2, 3])
+		self.assertEquals(tree.count_range(Item(0), Item(10)), 6)
+		self.assertEquals(tree.quantile(0).value, 1)
+		self.assertEquals(tree.cursor(Item(4)).item.value, 5)
+		self.assertEquals(node.item.value, 41)
+		self.assertTrue(refs[0]() is not None)
+
+		# Removing through a cursor leaves a tombstone too
+		cursor = tree.cursor(Item(5))
+		cursor.remove()
+		self.assertEquals(cursor.item.value, 7)
+		self.assertFalse(Item(5) in tree)
+		self.assertTrue(refs[5]() is not None)
+		self.assertRaises(RuntimeError, getattr, node, 'left_child')
+		del node
+
+		# Going past the threshold purges the tree
+		for i in xrange(40, 100):
+			tree.remove(Item(i))
+		self.assertTrue(all(ref() is None for ref in refs[40:81]))
+		self.assertTrue(refs[99]() is not None)
+		self.assertEquals(tree.locate(Item(50)), None)
+		self.assertEquals(tree.count_range(Item(0), Item(100)), 20)
+
+		# As does rebuilding it
+		tree.rebuild()
+		self.assertTrue(refs[99]() is None)
+		self.assertEquals(check_balanced(self, tree), 5)
+
+		# Tombstones met through handles hold None, and leave the tree
+		# and other handles alone
+		tree = binarytree.BinaryTree(xrange(15), tombstones=0.5)
+		tree.remove(3)
+		node = tree.locate(5)
+		left = tree.root.left_child
+		self.assertEquals(left.root.item, None)
+		self.assertEquals(left.root.left_child.root.item, 1)
+		self.assertEquals(tree.root.item, 7)
+		self.assertEquals(node.left_child.root.item, 4)
+		self.assertEquals(check_balanced(self, tree), 4)
+
+		# Trees with keys route lookups through them, and let items go
+		item = ''.join(['k'] * 16)
+		before = sys.getrefcount(item)
+		tree = binarytree.BinaryTree([item, 'j' * 16],
+					key_type='bytes16', tombstones=0.5)
+		tree.remove(item)
+		self.assertEquals(sys.getrefcount(item), before)
+		self.assertFalse(item in tree)
+		self.assertEquals(list(tree), ['j' * 16])
+		tree.insert(item)
+		self.assertEquals(list(tree), ['j' * 16, item])
+
+		self.assertRaises(ValueError, binarytree.BinaryTree,
+					tombstones=1)
+		self.assertRaises(ValueError, tree.__init__, tombstones=0)
+
+	def testRebuild(self):
+		''' Tests relinking trees into the least height for their size '''
+
+		for balance in ('avl', 'splay', 'treap', 'scapegoat'):
+			tree = binarytree.BinaryTree(balance=balance)
+			for item in xrange(1000):
+				tree.insert(item)
+			random.seed(0)
+			for item in random.sample(xrange(1000), 400):
+				tree.remove(item)
+			items = list(tree)
+
+			node = tree.locate(items[0])
+			cursor = tree.cursor()
+			tree.rebuild()
+
+			# 600 items fit in 10 levels
+			self.assertEquals(check_balanced(self, tree), 10)
+			self.assertEquals(list(tree), items)
+			self.assertEquals(node.item, items[0])
+			self.assertRaises(RuntimeError, cursor.next)
+
+			tree.insert(-1)
+			self.assertEquals(in_order(tree), [-1] + items)
+
+			tree.rebuild(compact=True)
+			self.assertEquals(tree.capacity, 601)
+			self.assertEquals(check_balanced(self, tree), 10)
+			self.assertRaises(RuntimeError, getattr, node, 'left_child')
+
+	def testMemcmpKeys(self):
+		''' Tests trees that compare their items through memcmp keys '''
+
+		random.seed(0)
+		items = [None, -1, 0.5, 2 ** 53 + 1, float(2 ** 53), 'a', 'a\0',
+			'ab', (), ('a',), ('a', None), ('a', 1), (('a',), 1)]
+		items += [(random.randrange(10), str(random.randrange(10)))
+				for i in xrange(100)]
+
+		tree = binarytree.BinaryTree(items, key_type='memcmp')
+		self.assertEquals(tree.key_type, 'memcmp')
+		self.assertEquals(list(tree), sorted(set(items)))
+		self.assertTrue(items[-1] in tree)
+		self.assertTrue(-1.0 in tree)
+		self.assertEquals(tree.cursor(('a', 0)).item, ('a', 1))
+
+		tree.remove(('a', 1))
+		tree.apply_batch([('b',), 1], ['a'])
+		self.assertEquals(list(tree),
+			sorted(set(items + [('b',), 1]) - set([('a', 1), 'a'])))
+
+		# Items that can't be encoded are rejected
+		self.assertRaises(TypeError, tree.insert, u'a')
+		self.assertRaises(TypeError, tree.insert, [1])
+		self.assertRaises(ValueError, tree.insert, float('nan'))
+		self.assertRaises(OverflowError, tree.insert, 2 ** 64)
+		self.assertRaises(ValueError, binarytree.BinaryTree,
+					key_type='unknown')
+		self.assertRaises(ValueError, tree.__init__, key_type=None)
+
+		self.assertEquals(binarytree.BinaryTree().key_type, None)
+
+	def testBinaryKeys(self):
+		''' Tests trees of fixed-width binary keys, kept in the nodes '''
+
+		random.seed(0)
+		for size in (16, 32):
+			items = [''.join(chr(random.randrange(256))
+					for i in xrange(size)) for j in xrange(200)]
+			items += ['\0' * size, '\xff' * size]
+
+			key_type = 'bytes%d' % size
+			tree = binarytree.BinaryTree(items, key_type=key_type)
+			self.assertEquals(tree.key_type, key_type)
+			self.assertEquals(list(tree), sorted(items))
+			self.assertTrue(items[7] in tree)
+
+			tree.apply_batch([], items[:100])
+			for item in items[100:150]:
+				tree.remove(item)
+			self.assertEquals(list(tree), sorted(items[150:]))
+			self.assertFalse(items[0] in tree)
+			self.assertEquals(tree.count_range(items[-2], items[-1]),
+						len(items) - 151)
+
+			self.assertRaises(ValueError, tree.insert, 'a' * (size - 1))
+			self.assertRaises(TypeError, tree.insert, u'a' * size)
+			self.assertRaises(TypeError, tree.insert, 1)
+
+	def testDatetimeKeys(self):
+		''' Tests trees that compare datetimes as microseconds '''
+
+		random.seed(0)
+		start = datetime.datetime(1970, 1, 1)
+		items = [start + datetime.timedelta(microseconds=random.randrange(
+				-10 ** 16, 10 ** 16)) for i in xrange(300)]
+		items += [datetime.datetime.min, datetime.datetime.max,
+				datetime.datetime(2000, 2, 29), start]
+
+		tree = binarytree.BinaryTree(items, key_type='datetime')
+		self.assertEquals(tree.key_type, 'datetime')
+		self.assertEquals(list(tree), sorted(items))
+		self.assertTrue(start in tree)
+
+		for item in items[:100]:
+			tree.remove(item)
+		self.assertEquals(list(tree), sorted(items[100:]))
+
+		# Datetimes with a UTC offset sort by their time in UTC
+		tree = binarytree.BinaryTree(key_type='datetime')
+		for minutes in (-600, 0, 30, 840):
+			tree.insert(datetime.datetime(2000, 1, 1, 12,
+					tzinfo=FixedOffset(minutes)))
+		self.assertEquals([item.utcoffset() for item in tree],
+			[datetime.timedelta(minutes=minutes)
+				for minutes in (840, 30, 0, -600)])
+		self.assertTrue(datetime.datetime(2000, 1, 1, 2, 0,
+				tzinfo=FixedOffset(-600)) in tree)
+
+		self.assertRaises(TypeError, tree.insert, datetime.date(2000, 1, 1))
+		self.assertRaises(TypeError, tree.insert, 0)
+
+		# Naive and aware datetimes don't compare, so a tree takes either
+		noon = datetime.datetime(2000, 1, 1, 12)
+		self.assertRaises(TypeError, tree.insert, noon)
+		self.assertRaises(TypeError, tree.__contains__, noon)
+		self.assertRaises(TypeError, tree.remove_range, noon,
+					noon.replace(tzinfo=FixedOffset(0)))
+		self.assertRaises(TypeError, tree.apply_batch, [noon], [])
+		self.assertEquals(len(list(tree)), 4)
+		self.assertRaises(TypeError, binarytree.BinaryTree,
+			[noon, noon.replace(tzinfo=FixedOffset(0))],
+			key_type='datetime')
+
+		tree.clear()
+		tree.insert(noon)
+		self.assertTrue(noon in tree)
+		self.assertRaises(TypeError, tree.__contains__,
+					noon.replace(tzinfo=FixedOffset(0)))
+
+	def testIntegerBulkBuild(self):
+		''' Tests bulk builds and batches of trees with integer keys '''
+
+		random.seed(0)
+		items = [random.randrange(-2 ** 63, 2 ** 63) for i in xrange(500)]
+		items += [random.randrange(-50, 50) for i in xrange(500)]
+		items += [-2 ** 63, 2 ** 63 - 1, True]
+
+		tree = binarytree.BinaryTree(iter(items), key_type='int64')
+		self.assertEquals(tree.key_type, 'int64')
+		self.assertEquals(list(tree), sorted(set(items)))
+		check_balanced(self, tree)
+
+		inserts = [random.randrange(-100, 100) for i in xrange(200)]
+		removes = items[::3] + inserts[::5]
+		tree.apply_batch(inserts, removes)
+		self.assertEquals(list(tree),
+			sorted((set(items) | set(inserts)) - set(removes)))
+
+		# Items that can't be encoded leave the tree unchanged
+		items = list(tree)
+		self.assertRaises(OverflowError, tree.apply_batch, [2 ** 63], [])
+		self.assertRaises(TypeError, tree.apply_batch, [], [1.5])
+		self.assertRaises(TypeError, binarytree.BinaryTree, [1, 'a'],
+					key_type='int64')
+		self.assertEquals(list(tree), items)
+
 if __name__ == "__main__":
 	unittest.main()
 